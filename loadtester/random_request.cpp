@@ -2,15 +2,24 @@
 #include <string>
 #include <vector>
 #include <cstdlib>
-#include <ctime>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
 #include <curl/curl.h>
 
+// rand() shares one hidden state across all user threads (and is not
+// required to be thread-safe), so each thread draws from its own engine
+int random_int(int bound) {
+    thread_local std::mt19937 rng(std::random_device{}());
+    return std::uniform_int_distribution<int>(0, bound - 1)(rng);
+}
+
 std::string random_string(int length) {
     std::string s;
     std::string chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
     for (int i = 0; i < length; ++i) {
-        s += chars[rand() % chars.size()];
+        s += chars[random_int(chars.size())];
     }
     return s;
 }
@@ -20,9 +29,97 @@ size_t write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
     return size * nmemb;
 }
 
+int env_int(const char* name, int def) {
+    if (const char* env_p = std::getenv(name)) {
+        try {
+            return std::stoi(env_p);
+        } catch (...) {
+            std::cerr << "Warning: Invalid " << name << " value. Using default (" << def << ").\n";
+        }
+    }
+    return def;
+}
+
+// Totals across all worker threads, reported periodically by main()
+std::atomic<long long> completed{0};
+std::atomic<long long> failed{0};
+std::atomic<long long> latency_us{0};
+std::atomic<long long> connects{0};
+
+// One simulated user: its own CURL handle, so with KEEP_ALIVE=1 the TCP
+// connection is reused across requests instead of reopened every time.
+void run_user(const std::string BASE_URL, int GET_THRESHOLD, int PUT_THRESHOLD,
+              bool keep_alive, bool verbose, int sleep_ms) {
+    CURL* curl = curl_easy_init();
+    if (!curl) return;
+
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    if (!keep_alive)
+        headers = curl_slist_append(headers, "Connection: close");
+
+    while (true) {
+        int r = random_int(100);
+        std::string method ;
+        if (r < GET_THRESHOLD) {
+            method = "GET";
+        } else if (r < PUT_THRESHOLD) {
+            method = "PUT";
+        } else {
+            method = "DELETE";
+        }
+        std::string key = std::to_string(random_int(100000));
+        std::string url = BASE_URL + "/" + key;
+        std::string data = "{\"value\":\"" + random_string(127) + "\"}";
+        std::string response;
+
+        // curl_easy_reset keeps the handle's connection cache intact
+        curl_easy_reset(curl);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+        if (!keep_alive)
+            curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+
+        if (method == "PUT" || method == "POST") {
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
+        } else if (method == "DELETE") {
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+        } else {
+            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        CURLcode res = curl_easy_perform(curl);
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start).count();
+
+        if(res != CURLE_OK) {
+            failed++;
+            std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
+        } else {
+            completed++;
+            latency_us += us;
+            long new_conns = 0;
+            curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_conns);
+            connects += new_conns;
+            if (verbose)
+                std::cout << method << " " << url << " → " << response << std::endl;
+        }
+
+        if (sleep_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));// 500  || 50 
+    }
+
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+}
+
 int main() {
     std::cout<<"load tester started : \n";
-    srand(time(0));
     const std::string BASE_URL = "http://kv_server:8080/kv";
 
     int get_percent = 70; // Default values
@@ -57,58 +154,35 @@ int main() {
               << "%, PUT=" << put_percent
               << "%, DELETE=" << (100 - PUT_THRESHOLD) << "%\n";
 
-    CURL* curl;
-    CURLcode res;
+    // USERS concurrent users (threads); KEEP_ALIVE=0 forces a new TCP
+    // connection per request so both modes can be compared
+    int users = env_int("USERS", 1);
+    bool keep_alive = env_int("KEEP_ALIVE", 1) != 0;
+    bool verbose = env_int("VERBOSE", 1) != 0;
+    int sleep_ms = env_int("SLEEP_MS", 5);
+    std::cout << "Users=" << users << ", keep-alive=" << (keep_alive ? "on" : "off") << "\n";
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
 
-    curl = curl_easy_init();
-    if(!curl) return 1;
-
+    std::vector<std::thread> workers;
+    for (int i = 0; i < users; ++i)
+        workers.emplace_back(run_user, BASE_URL, GET_THRESHOLD, PUT_THRESHOLD, keep_alive, verbose, sleep_ms);
 
+    // Report throughput, mean latency and new TCP connections every 5s
+    long long last_done = 0, last_lat = 0, last_conn = 0;
     while (true) {
-        int r = rand() % 100;
-        std::string method ;
-        if (r < GET_THRESHOLD) {
-            method = "GET";
-        } else if (r < PUT_THRESHOLD) {
-            method = "PUT";
-        } else {
-            method = "DELETE";
-        }
-        std::string key = std::to_string(rand()%100000);
-        std::string url = BASE_URL + "/" + key;
-        std::string data = "{\"value\":\"" + random_string(127) + "\"}";
-        std::string response;
-
-        curl_easy_reset(curl);
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-        if (method == "PUT" || method == "POST") {
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
-            struct curl_slist* headers = nullptr;
-            headers = curl_slist_append(headers, "Content-Type: application/json");
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
-        } else if (method == "DELETE") {
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-        } else {
-            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-        }
-
-        res = curl_easy_perform(curl);
-        if(res != CURLE_OK)
-            std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-        else
-            std::cout << method << " " << url << " → " << response << std::endl;
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));// 500  || 50 
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+        long long done = completed, lat = latency_us, conn = connects;
+        long long n = done - last_done;
+        std::cerr << "[stats] " << n / 5.0 << " req/s, avg latency "
+                  << (n ? (lat - last_lat) / 1000.0 / n : 0.0) << " ms, "
+                  << (conn - last_conn) / 5.0 << " new conn/s, failed " << failed << "\n";
+        last_done = done;
+        last_lat = lat;
+        last_conn = conn;
     }
 
-    curl_easy_cleanup(curl);
+    for (auto& w : workers) w.join();
     curl_global_cleanup();
     return 0;
 }
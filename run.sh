@@ -1,17 +1,25 @@
-$ #!/bin/bash
+#!/bin/bash
 
-SERVER="http://localhost:8080/kv"
+SERVER="http://localhost:8080"
+TOTAL=10000
+# Keys per /mset request (the server accepts up to 1000)
+BATCH=1000
 
-for i in $(seq 1 10000); do
-    key="key$i"
-    value="value$i"
-    curl -s -X PUT "$SERVER/$key" \
+# kv_store.k is an INTEGER column, so keys are plain numbers
+for ((start = 1; start <= TOTAL; start += BATCH)); do
+    end=$((start + BATCH - 1))
+    (( end > TOTAL )) && end=$TOTAL
+    body="{"
+    for ((i = start; i <= end; i++)); do
+        (( i > start )) && body+=","
+        body+="\"$i\":\"value$i\""
+    done
+    body+="}"
+    curl -s -X POST "$SERVER/mset" \
          -H "Content-Type: application/json" \
-         -d "{\"value\":\"$value\"}" \
+         -d "$body" \
          >/dev/null
-    if (( i % 1000 == 0 )); then
-        echo "$i keys inserted..."
-    fi
+    echo "$end keys inserted..."
 done
 
-echo "Done inserting 10000 key-value pairs!"
+echo "Done inserting $TOTAL key-value pairs!"
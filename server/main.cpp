@@ -8,481 +8,5542 @@
 #include <sstream>
 #include <thread>
 #include<list>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <shared_mutex>
+#include <deque>
+#include <cmath>
+#include <future>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cstdio>
+#include <unistd.h>
+#include <cstring>
+#include <charconv>
+#include <ctime>
+#include <cstdint>
+#include <cstdlib>
 
 #include <libpq-fe.h> //-> for db
 #include "CivetServer.h"
 #include <nlohmann/json.hpp> //fot json
 
 #include <unordered_map> 
+#include <unordered_set>
 #include <mutex>         
 //#include <scoped_lock>   
 
-    // Define the max number of items for the LRU cache
+    // Define the max number of items for the LRU cache (0 = no item limit)
     const size_t CACHE_MAX_ITEMS = 10000;
+    // Byte budget for keys + values + per-entry overhead (0 = no byte limit)
+    const size_t CACHE_MAX_BYTES = 0;
+    // Approximate bookkeeping cost of one cached entry beyond its key and
+    // value bytes: the slab entry, its index bucket and allocator slack.
+    const size_t CACHE_ENTRY_OVERHEAD = 96;
+    // Default shard count; 0 means "derive from hardware_concurrency()"
+    const size_t CACHE_DEFAULT_SHARDS = 0;
+    // Default eviction policy for every shard: "lru", "clock" or "tinylfu"
+    const char *CACHE_DEFAULT_POLICY = "lru";
+    // Negative cache: how many absent keys are remembered, and for how
+    // long (0 for either disables it)
+    const size_t NEG_CACHE_MAX_ITEMS = 10000;
+    const size_t NEG_CACHE_TTL_MS = 5000;
+    // Startup warm-up: parallel key-range slices, each on its own pooled
+    // connection (0 disables warm-up)
+    const size_t CACHE_WARMUP_SLICES = 4;
+    // Elastic PGPool bounds, acquire() timeout, health-probe period and
+    // how long a connection above the minimum may sit idle
+    const size_t PG_POOL_MIN = 4;
+    const size_t PG_POOL_MAX = 16;
+    const size_t PG_ACQUIRE_TIMEOUT_MS = 5000;
+    const size_t PG_HEALTH_INTERVAL_MS = 1000;
+    const size_t PG_IDLE_TIMEOUT_MS = 60000;
+    // Pipeline executor (DB_MODE=pipeline): connections and statements
+    // sent per round trip on each
+    const size_t PG_PIPELINE_CONNS = 2;
+    const size_t PG_PIPELINE_DEPTH = 64;
+    // Write-behind (WRITE_MODE=writebehind): flush interval, i.e. the
+    // durability window, batch size that forces an early flush, the
+    // journal file ("none" disables it) and how many keys may wait before
+    // writes are refused with 503 (0 = unlimited)
+    const size_t WB_FLUSH_MS = 50;
+    const size_t WB_BATCH_MAX = 1000;
+    const char *WB_JOURNAL = "writebehind.journal";
+    const size_t WB_MAX_PENDING = 100000;
+    // Group commit (WRITE_MODE=group): most writes one transaction takes
+    const size_t GROUP_COMMIT_MAX = 1000;
+    // civetweb worker threads and how long an idle keep-alive connection
+    // may hold one
+    const size_t HTTP_THREADS = 256;
+    const size_t HTTP_KEEP_ALIVE_MS = 1000;
+    // Miss batching: how long a cache miss may wait for others to share
+    // its query while another batch is out (0 disables batching), the
+    // most keys per query and how many batch queries may run at once
+    const size_t MISS_BATCH_WINDOW_US = 200;
+    const size_t MISS_BATCH_MAX_KEYS = 64;
+    const size_t MISS_BATCH_WORKERS = 4;
+    // Request bodies are read in blocks of this size; PUT values larger
+    // than the threshold are streamed to Postgres with COPY instead of
+    // being assembled in memory
+    const size_t BODY_BLOCK_SIZE = 64 * 1024;
+    const size_t PUT_STREAM_THRESHOLD = 1024 * 1024;
+    // Binary protocol listener port (0, the default, disables it),
+    // connection cap and largest accepted frame payload. A frame is
+    // buffered whole, so the cap matches the largest PUT the HTTP API
+    // assembles in memory
+    const size_t BIN_PORT = 0;
+    const size_t BIN_MAX_CONNS = 256;
+    const size_t BIN_MAX_FRAME = PUT_STREAM_THRESHOLD;
+    // Most keys accepted by one batch request
+    const size_t BATCH_MAX_KEYS = 1000;
+    // Range scans: rows fetched per keyset page (one chunk each) and the
+    // default row limit when the request gives none (0 = unlimited)
+    const size_t SCAN_PAGE_SIZE = 500;
+    const size_t SCAN_DEFAULT_LIMIT = 1000;
 
 using json = nlohmann::json;
 
 
-class PGPool
+// Owning handle for a PGresult
+using PGresultPtr = std::unique_ptr<PGresult, void (*)(PGresult *)>;
+
+// Result of one statement. `error` is set when the statement or the
+// connection failed; `res` may still hold the error result.
+struct DbReply
+{
+    PGresultPtr res{nullptr, &PQclear};
+    std::string error;
+
+    bool ok() const { return error.empty(); }
+};
+
+static DbReply make_reply(PGconn *c, PGresult *r)
+{
+    DbReply reply;
+    reply.res.reset(r);
+    ExecStatusType st = r ? PQresultStatus(r) : PGRES_FATAL_ERROR;
+    if (st != PGRES_TUPLES_OK && st != PGRES_COMMAND_OK)
+    {
+        const char *msg = r ? PQresultErrorMessage(r) : "";
+        reply.error = (msg && *msg) ? msg : PQerrorMessage(c);
+        if (reply.error.empty())
+            reply.error = "connection lost";
+    }
+    return reply;
+}
+
+// Runs a statement that returns nothing on `c`; returns false with `err`
+// set.
+static bool run_sql(PGconn *c, const char *sql, std::string &err)
+{
+    DbReply r = make_reply(c, PQexec(c, sql));
+    if (!r.ok())
+        err = r.error;
+    return r.ok();
+}
+
+// Runs fn(err) between BEGIN and COMMIT on `c`, rolling back if any step
+// fails; returns false with `err` set.
+static bool run_in_transaction(PGconn *c, const std::function<bool(std::string &)> &fn, std::string &err)
+{
+    bool ok = run_sql(c, "BEGIN", err) && fn(err) && run_sql(c, "COMMIT", err);
+    if (!ok)
+    {
+        std::string ignored;
+        run_sql(c, "ROLLBACK", ignored);
+    }
+    return ok;
+}
+
+// Creates the table and its indexes. Runs before any statement is
+// prepared, since preparing needs the table to exist.
+static void create_schema(PGconn *c)
+{
+    const char *create =
+        "CREATE TABLE IF NOT EXISTS kv_store ("
+        "k INTEGER ,"
+        "v TEXT,"
+        "PRIMARY KEY (v, k),"
+        "updated_at TIMESTAMP DEFAULT now()"
+        ");"
+        // Arbiter for ON CONFLICT(k) (the primary key is (v, k)); range
+        // scans also walk keys in order through it
+        "CREATE UNIQUE INDEX IF NOT EXISTS kv_store_k_key ON kv_store (k);"
+        // Cache warm-up loads the most recently written rows
+        "CREATE INDEX IF NOT EXISTS kv_store_updated_at_idx ON kv_store (updated_at DESC)";
+    PGresult *r = PQexec(c, create);
+    if (PQresultStatus(r) != PGRES_COMMAND_OK)
+    {
+        std::string msg = PQerrorMessage(c);
+        PQclear(r);
+        throw std::runtime_error("Failed to create table: " + msg);
+    }
+    PQclear(r);
+}
+
+static bool prepare(PGconn *c, const char *name, const char *sql, int n_params)
+{
+    PGresult *r = PQprepare(c, name, sql, n_params, nullptr);
+    bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+    if (!ok)
+        std::cerr << "Preparing " << name << " failed: " << PQerrorMessage(c) << std::endl;
+    PQclear(r);
+    return ok;
+}
+
+// Connects and prepares the kv_* statements on the new connection; with
+// `create` set, creates the schema first. Returns nullptr (after logging
+// why) if the connection or any statement failed.
+static PGconn *open_pg_connection(const std::string &conninfo, bool create = false)
+{
+    PGconn *c = PQconnectdb(conninfo.c_str());
+    if (PQstatus(c) != CONNECTION_OK)
+    {
+        std::cerr << "Postgres connect failed: " << PQerrorMessage(c) << std::endl;
+        PQfinish(c);
+        return nullptr;
+    }
+
+    if (create)
+    {
+        try
+        {
+            create_schema(c);
+        }
+        catch (...)
+        {
+            PQfinish(c);
+            throw;
+        }
+    }
+
+    // Prepare statements for this connection
+    bool ok =
+        prepare(c, "kv_get", "SELECT v FROM kv_store WHERE k=$1", 1) &&
+        prepare(c, "kv_put",
+                "INSERT INTO kv_store(k,v) VALUES($1,$2) "
+                "ON CONFLICT(k) DO UPDATE SET v=EXCLUDED.v, updated_at=now()",
+                2) &&
+        prepare(c, "kv_del", "DELETE FROM kv_store WHERE k=$1", 1) &&
+        prepare(c, "kv_mget", "SELECT k, v FROM kv_store WHERE k = ANY($1::int[])", 1) &&
+        // Batch writes are single statements, so each is its own transaction
+        prepare(c, "kv_mput",
+                "INSERT INTO kv_store(k,v) SELECT * FROM unnest($1::int[], $2::text[]) "
+                "ON CONFLICT(k) DO UPDATE SET v=EXCLUDED.v, updated_at=now()",
+                2) &&
+        prepare(c, "kv_mdel", "DELETE FROM kv_store WHERE k = ANY($1::int[])", 1) &&
+        prepare(c, "kv_scan",
+                "SELECT k, v FROM kv_store WHERE k >= $1 AND k <= $2 ORDER BY k LIMIT $3",
+                3);
+
+    // Staging table for COPY loads (see CopyUpsert); made once per
+    // session rather than per load, which would log a NOTICE each time
+    std::string err;
+    if (ok && !run_sql(c, "CREATE TEMP TABLE kv_ingest (n BIGSERIAL, k INTEGER, v TEXT)", err))
+    {
+        std::cerr << "Creating kv_ingest failed: " << err << std::endl;
+        ok = false;
+    }
+    if (!ok)
+    {
+        PQfinish(c);
+        return nullptr;
+    }
+    return c;
+}
+
+/**
+ *  Bounded lock-free multi-producer/multi-consumer ring (Vyukov's
+ *  sequence-numbered slots). Push and pop are a CAS on a shared cursor
+ *  plus a release store on the slot; neither ever takes a lock.
+ */
+template <typename T>
+class MpmcRing
 {
 private:
-    std::string conninfo_;
-    std::queue<PGconn *> conns_;
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0}; // next pop
+    alignas(64) std::atomic<size_t> tail_{0}; // next push
+
+public:
+    explicit MpmcRing(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        cells_.reset(new Cell[n]);
+        mask_ = n - 1;
+        for (size_t i = 0; i < n; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T v)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &c = cells_[pos & mask_];
+            intptr_t diff = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.value = std::move(v);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // full
+            else
+                pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_pop(T &out)
+    {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &c = cells_[pos & mask_];
+            intptr_t diff = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    out = std::move(c.value);
+                    c.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // empty
+            else
+                pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+
+    size_t size_approx() const
+    {
+        size_t t = tail_.load(std::memory_order_relaxed);
+        size_t h = head_.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+};
+
+/**
+ *  Hands items (idle connections) between threads. The uncontended path
+ *  is a lock-free ring pop/push with no syscall; only a taker that finds
+ *  the ring empty registers as a waiter and sleeps on a condition
+ *  variable, and givers take the mutex to wake it only when a waiter is
+ *  registered.
+ */
+template <typename T>
+class SlotHandoff
+{
+private:
+    MpmcRing<T> ring_;
+    std::atomic<int> waiters_{0};
     std::mutex m_;
     std::condition_variable cv_;
 
 public:
-    PGPool(const std::string &conninfo, int pool_size = 4)
-        : conninfo_(conninfo)
+    explicit SlotHandoff(size_t capacity) : ring_(capacity) {}
+
+    bool try_take(T &out) { return ring_.try_pop(out); }
+
+    // Blocks until an item arrives or `deadline` passes.
+    bool take_until(T &out, std::chrono::steady_clock::time_point deadline)
+    {
+        if (ring_.try_pop(out))
+            return true;
+        // Registering before re-checking pairs with give()'s push, fence,
+        // then check-waiters, so a wakeup can't be lost.
+        waiters_.fetch_add(1);
+        std::unique_lock<std::mutex> lk(m_);
+        bool got = cv_.wait_until(lk, deadline, [&]
+                                  { return ring_.try_pop(out); });
+        waiters_.fetch_sub(1);
+        return got;
+    }
+
+    void give(T v)
+    {
+        // Capacity covers every item in circulation, so this only spins
+        // if a caller over-gives.
+        while (!ring_.try_push(v))
+            std::this_thread::yield();
+        // The push ends in a release store, which a later load may pass
+        // (StoreLoad); the fence orders it before reading waiters_.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load() > 0)
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            cv_.notify_one();
+        }
+    }
+
+    size_t size_approx() const { return ring_.size_approx(); }
+};
+
+struct PoolConfig
+{
+    size_t min_size = PG_POOL_MIN;
+    size_t max_size = PG_POOL_MAX;
+    size_t acquire_timeout_ms = PG_ACQUIRE_TIMEOUT_MS;
+    size_t health_interval_ms = PG_HEALTH_INTERVAL_MS;
+    size_t idle_timeout_ms = PG_IDLE_TIMEOUT_MS;
+};
+
+/**
+ *  Elastic connection pool. Keeps at least `min_size` connections, opens
+ *  more on demand up to `max_size`, and closes extras that sit idle for
+ *  `idle_timeout_ms`. Idle connections are reused round-robin, so "idle"
+ *  is judged by the idle count: if it never dropped below N during a
+ *  whole timeout window, N connections were not needed. A connection that comes back broken is dropped on
+ *  release, and a maintenance thread probes idle connections and
+ *  replaces dead ones in the background. Only that thread connects:
+ *  a connect can block far longer than any request should wait, so
+ *  acquire() just asks it for a connection. acquire() gives up after
+ *  `acquire_timeout_ms` and returns nullptr; its wait times are kept in
+ *  a histogram for /stats.
+ */
+class PGPool
+{
+private:
+    // Upper bounds (microseconds) of the acquire wait-time buckets; the
+    // last bucket catches everything slower.
+    static constexpr uint64_t WAIT_BUCKETS_US[] = {10, 100, 1000, 10000, 100000, 1000000};
+    static constexpr size_t N_WAIT_BUCKETS = sizeof(WAIT_BUCKETS_US) / sizeof(WAIT_BUCKETS_US[0]) + 1;
+
+    std::string conninfo_;
+    PoolConfig config_;
+    // Idle connections; acquire/release are lock-free unless the pool is empty
+    SlotHandoff<PGconn *> idle_;
+    std::atomic<size_t> total_{0}; // idle + handed out + being opened
+    // Lowest idle count seen by acquire() since the last reap
+    std::atomic<size_t> idle_low_{SIZE_MAX};
+
+    // Only the maintenance thread sleeps on these
+    std::mutex maint_m_;
+    std::condition_variable maint_cv_;
+    bool stopping_ = false;
+    std::thread maintainer_;
+    // Connections asked for by acquire() or to replace dropped ones
+    std::atomic<size_t> wanted_{0};
+
+    std::atomic<uint64_t> wait_hist_[N_WAIT_BUCKETS] = {};
+    std::atomic<uint64_t> timeouts_{0};
+    std::atomic<uint64_t> opened_{0};
+    std::atomic<uint64_t> dropped_{0};
+
+    void note_idle_count()
+    {
+        size_t n = idle_.size_approx();
+        size_t low = idle_low_.load(std::memory_order_relaxed);
+        while (n < low && !idle_low_.compare_exchange_weak(low, n, std::memory_order_relaxed))
+            ;
+    }
+
+    void record_wait(std::chrono::steady_clock::duration d)
+    {
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        size_t b = 0;
+        while (b < N_WAIT_BUCKETS - 1 && us >= WAIT_BUCKETS_US[b])
+            ++b;
+        wait_hist_[b].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Claims a slot under max_size (or `limit`) for a new connection.
+    bool reserve_slot(size_t limit)
+    {
+        size_t t = total_.load();
+        while (t < limit)
+        {
+            if (total_.compare_exchange_weak(t, t + 1))
+                return true;
+        }
+        return false;
+    }
+
+    // Opens a connection into a reserved slot; gives the slot back on failure.
+    PGconn *open_reserved()
+    {
+        PGconn *c = open_pg_connection(conninfo_);
+        if (!c)
+        {
+            total_--;
+            return nullptr;
+        }
+        opened_++;
+        return c;
+    }
+
+    // A cheap liveness probe for an idle connection: reads whatever the
+    // server sent (e.g. a termination notice) without a round trip.
+    static bool healthy(PGconn *c)
+    {
+        return PQstatus(c) == CONNECTION_OK && PQconsumeInput(c) == 1 && PQstatus(c) == CONNECTION_OK;
+    }
+
+    // Asks the maintenance thread for one more connection.
+    void want_connection()
+    {
+        std::lock_guard<std::mutex> lk(maint_m_);
+        wanted_++;
+        maint_cv_.notify_one();
+    }
+
+    void maintain()
     {
-        for (int i = 0; i < pool_size; ++i)
+        auto interval = std::chrono::milliseconds(config_.health_interval_ms);
+        auto idle_timeout = std::chrono::milliseconds(config_.idle_timeout_ms);
+        auto next_probe = std::chrono::steady_clock::now() + interval;
+        auto next_reap = std::chrono::steady_clock::now() + idle_timeout;
+        std::unique_lock<std::mutex> lk(maint_m_);
+        while (!stopping_)
         {
-            PGconn *c = PQconnectdb(conninfo_.c_str());
-            if (PQstatus(c) != CONNECTION_OK)
+            maint_cv_.wait_until(lk, next_probe, [&]
+                                 { return stopping_ || wanted_ > 0; });
+            if (stopping_)
+                break;
+            lk.unlock();
+
+            // Grow by what was asked for, up to max_size
+            size_t want = wanted_.exchange(0);
+            while (want > 0 && reserve_slot(config_.max_size))
             {
-                std::cerr << "Postgres connect failed: " << PQerrorMessage(c) << std::endl;
-                PQfinish(c);
-                throw std::runtime_error("Failed to connect to Postgres");
+                --want;
+                PGconn *c = open_reserved();
+                if (!c)
+                    break; // waiters time out; the next one asks again
+                idle_.give(c);
             }
 
-            // Only the first connection creates the table
-            if (i == 0)
+            if (std::chrono::steady_clock::now() < next_probe)
             {
-                const char *create =
-                    "CREATE TABLE IF NOT EXISTS kv_store ("
-                    "k INTEGER ,"
-                    "v TEXT,"
-                    "PRIMARY KEY (v, k),"
-                    "updated_at TIMESTAMP DEFAULT now()"
-                    ")";
-                PGresult *r = PQexec(c, create);
-                if (PQresultStatus(r) != PGRES_COMMAND_OK)
+                lk.lock();
+                continue;
+            }
+            next_probe = std::chrono::steady_clock::now() + interval;
+
+            // Probe idle connections and drop dead ones. One at a time,
+            // each put back before the next is taken, so acquire() never
+            // finds the ring emptied by the probe and asks for a
+            // connection it doesn't need. The ring is FIFO, so taking as
+            // many as were idle visits each one once.
+            PGconn *c;
+            for (size_t n = idle_.size_approx(); n > 0 && idle_.try_take(c); --n)
+            {
+                if (healthy(c))
+                    idle_.give(c);
+                else
                 {
-                    std::string msg = PQerrorMessage(c);
-                    PQclear(r);
+                    dropped_++;
                     PQfinish(c);
-                    throw std::runtime_error("Failed to create table: " + msg);
+                    total_--;
                 }
-                PQclear(r);
             }
 
-            // Prepare statements for this connection
-            PQclear(PQprepare(c, "kv_get", "SELECT v FROM kv_store WHERE k=$1", 1, nullptr));
-            PQclear(PQprepare(c, "kv_put",
-                              "INSERT INTO kv_store(k,v) VALUES($1,$2) "
-                              "ON CONFLICT(k) DO UPDATE SET v=EXCLUDED.v, updated_at=now()",
-                              2, nullptr));
-            PQclear(PQprepare(c, "kv_del", "DELETE FROM kv_store WHERE k=$1", 1, nullptr));
+            // Close the connections that stayed idle for a whole window
+            auto now = std::chrono::steady_clock::now();
+            if (now >= next_reap)
+            {
+                next_reap = now + idle_timeout;
+                size_t unused = std::min(idle_low_.exchange(SIZE_MAX), idle_.size_approx());
+                while (unused > 0 && total_ > config_.min_size && idle_.try_take(c))
+                {
+                    PQfinish(c);
+                    total_--;
+                    --unused;
+                }
+            }
+
+            // Refill to the minimum
+            while (reserve_slot(config_.min_size))
+            {
+                c = open_reserved();
+                if (!c)
+                    break; // retry on the next tick
+                idle_.give(c);
+            }
+            lk.lock();
+        }
+    }
+
+public:
+    PGPool(const std::string &conninfo, const PoolConfig &config = PoolConfig())
+        : conninfo_(conninfo), config_(config),
+          idle_(std::max(config.max_size, config.min_size))
+    {
+        config_.min_size = std::max<size_t>(1, config_.min_size);
+        config_.max_size = std::max(config_.max_size, config_.min_size);
 
-            // Push the now fully-initialized connection into the pool
+        for (size_t i = 0; i < config_.min_size; ++i)
+        {
+            // Only the first connection creates the schema
+            PGconn *c = open_pg_connection(conninfo_, total_ == 0);
+            if (!c)
+                continue; // the maintainer keeps retrying
 
-            std::cout << "DEBUG: Connection " << i + 1 << " established and prepared.\n";//
-    conns_.push(c);
-    std::cout << "DEBUG: Connection " << i + 1 << " pushed to queue. Queue size: " << conns_.size() << "\n";//
+            idle_.give(c);
+            total_++;
+            opened_++;
         }
+        if (total_ == 0)
+            throw std::runtime_error("Failed to connect to Postgres");
+        std::cout << "Postgres pool: " << total_ << " connections (min " << config_.min_size
+                  << ", max " << config_.max_size << ")\n";
+
+        maintainer_ = std::thread(&PGPool::maintain, this);
     }
 
     // Destructor
     ~PGPool()
     {
-        std::lock_guard<std::mutex> lk(m_);
-        while (!conns_.empty())
         {
-            PQfinish(conns_.front());
-            conns_.pop();
+            std::lock_guard<std::mutex> lk(maint_m_);
+            stopping_ = true;
+        }
+        maint_cv_.notify_all();
+        maintainer_.join();
+
+        PGconn *c;
+        while (idle_.try_take(c))
+            PQfinish(c);
+    }
+
+    // Returns nullptr if no connection could be had within the timeout.
+    PGconn *acquire()
+    {
+        auto start = std::chrono::steady_clock::now();
+        PGconn *c;
+        // Fast path: an idle connection, no lock and no syscall
+        if (idle_.try_take(c))
+        {
+            note_idle_count();
+            record_wait(std::chrono::steady_clock::now() - start);
+            return c;
+        }
+
+        // Room to grow: have the maintainer open a connection, then take
+        // whichever connection turns up first
+        if (total_ < config_.max_size)
+            want_connection();
+        auto deadline = start + std::chrono::milliseconds(config_.acquire_timeout_ms);
+        if (idle_.take_until(c, deadline))
+        {
+            note_idle_count();
+            record_wait(std::chrono::steady_clock::now() - start);
+            return c;
+        }
+        timeouts_++;
+        return nullptr;
+    }
+
+    void release(PGconn *c)
+    {
+        if (PQstatus(c) != CONNECTION_OK)
+        {
+            // Never hand a broken connection out again; the maintainer
+            // opens a replacement.
+            PQfinish(c);
+            total_--;
+            dropped_++;
+            want_connection();
+            return;
+        }
+        idle_.give(c);
+    }
+    // Blocking PQexecPrepared on a pooled connection.
+    DbReply exec(const char *stmt, int n_params, const char *const *params)
+    {
+        PGconn *pg = acquire();
+        if (!pg)
+        {
+            DbReply reply;
+            reply.error = "timed out waiting for a database connection";
+            return reply;
+        }
+        DbReply reply = make_reply(pg, PQexecPrepared(pg, stmt, n_params, params, nullptr, nullptr, 0));
+        release(pg);
+        return reply;
+    }
+
+    json stats()
+    {
+        json waits = json::object();
+        for (size_t b = 0; b < N_WAIT_BUCKETS; ++b)
+        {
+            std::string label = b < N_WAIT_BUCKETS - 1 ? "lt_" + std::to_string(WAIT_BUCKETS_US[b]) + "us"
+                                                       : "ge_" + std::to_string(WAIT_BUCKETS_US[b - 1]) + "us";
+            waits[label] = wait_hist_[b].load(std::memory_order_relaxed);
+        }
+        return json{{"size", total_.load()},
+                    {"idle", idle_.size_approx()},
+                    {"min", config_.min_size},
+                    {"max", config_.max_size},
+                    {"opened", opened_.load()},
+                    {"dropped", dropped_.load()},
+                    {"timeouts", timeouts_.load()},
+                    {"acquire_wait", waits}};
+    }
+};
+
+// ---------- PGPipeline ----------
+/**
+ *  Asynchronous statement executor built on libpq pipeline mode.
+ *
+ *  Callers enqueue a prepared statement and get a future. One I/O thread
+ *  per connection drains the queue in batches: every statement in a batch
+ *  is sent with PQsendQueryPrepared followed by its own PQpipelineSync
+ *  (so each keeps its own implicit transaction, as with PQexecPrepared),
+ *  the batch is flushed in one write, and results are matched back in
+ *  order. Many in-flight requests thus share a few connections instead of
+ *  each holding one for a full round trip.
+ */
+class PGPipeline
+{
+private:
+    struct Op
+    {
+        const char *stmt;
+        std::vector<std::string> params;
+        std::promise<DbReply> done;
+    };
+
+    std::string conninfo_;
+    size_t max_batch_;
+    std::deque<Op> queue_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+
+    static PGconn *open(const std::string &conninfo)
+    {
+        PGconn *c = open_pg_connection(conninfo);
+        if (!c)
+            return nullptr;
+        if (PQenterPipelineMode(c) != 1 || PQsetnonblocking(c, 1) != 0)
+        {
+            std::cerr << "Pipeline mode unavailable: " << PQerrorMessage(c) << std::endl;
+            PQfinish(c);
+            return nullptr;
+        }
+        return c;
+    }
+
+    // Waits until the socket is readable (and writable, while output is
+    // still queued) and feeds libpq. Returns false if the connection died.
+    static bool pump(PGconn *c)
+    {
+        int flush = PQflush(c);
+        if (flush < 0)
+            return false;
+        pollfd p{PQsocket(c), (short)(POLLIN | (flush ? POLLOUT : 0)), 0};
+        if (poll(&p, 1, -1) < 0 && errno != EINTR)
+            return false;
+        return PQconsumeInput(c) == 1;
+    }
+
+    // Next result in the pipeline, or nullptr at a query boundary. Sets
+    // `broken` if the connection failed instead.
+    static PGresult *next_result(PGconn *c, bool &broken)
+    {
+        while (PQisBusy(c))
+        {
+            if (!pump(c))
+            {
+                broken = true;
+                return nullptr;
+            }
+        }
+        return PQgetResult(c);
+    }
+
+    // Returns false if the connection is no longer usable.
+    bool run_batch(PGconn *c, std::vector<Op> &batch)
+    {
+        size_t sent = 0;
+        for (; sent < batch.size(); ++sent)
+        {
+            Op &op = batch[sent];
+            std::vector<const char *> values;
+            for (auto &p : op.params)
+                values.push_back(p.c_str());
+            if (!PQsendQueryPrepared(c, op.stmt, (int)values.size(), values.data(), nullptr, nullptr, 0) ||
+                !PQpipelineSync(c))
+                break;
+        }
+
+        bool broken = sent < batch.size();
+        while (!broken)
+        {
+            int f = PQflush(c);
+            if (f == 0)
+                break;
+            if (f < 0 || !pump(c))
+                broken = true;
+        }
+
+        size_t i = 0;
+        for (; i < sent && !broken; ++i)
+        {
+            // Keep the statement's first result; skip its NULL terminator
+            // and stop at the sync point that closes its transaction.
+            PGresult *first = nullptr;
+            while (true)
+            {
+                PGresult *r = next_result(c, broken);
+                if (broken)
+                    break;
+                if (!r)
+                    continue;
+                if (PQresultStatus(r) == PGRES_PIPELINE_SYNC)
+                {
+                    PQclear(r);
+                    break;
+                }
+                if (!first)
+                    first = r;
+                else
+                    PQclear(r);
+            }
+            if (broken)
+            {
+                PQclear(first);
+                break;
+            }
+            batch[i].done.set_value(make_reply(c, first));
+        }
+
+        for (; i < batch.size(); ++i)
+        {
+            DbReply reply;
+            reply.error = std::string("pipeline connection lost: ") + PQerrorMessage(c);
+            batch[i].done.set_value(std::move(reply));
+        }
+        return !broken;
+    }
+
+    void worker()
+    {
+        PGconn *c = open(conninfo_);
+        std::vector<Op> batch;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lk(m_);
+                cv_.wait(lk, [&]
+                         { return stopping_ || !queue_.empty(); });
+                if (stopping_ && queue_.empty())
+                    break;
+                while (!queue_.empty() && batch.size() < max_batch_)
+                {
+                    batch.push_back(std::move(queue_.front()));
+                    queue_.pop_front();
+                }
+            }
+
+            if (!c)
+                c = open(conninfo_);
+            if (c)
+            {
+                if (!run_batch(c, batch))
+                {
+                    // Results may be half-read: start over on a new connection
+                    PQfinish(c);
+                    c = nullptr;
+                }
+            }
+            else
+            {
+                for (auto &op : batch)
+                {
+                    DbReply reply;
+                    reply.error = "pipeline connection unavailable";
+                    op.done.set_value(std::move(reply));
+                }
+            }
+            batch.clear();
+        }
+        if (c)
+            PQfinish(c);
+    }
+
+public:
+    PGPipeline(const std::string &conninfo, size_t connections, size_t max_batch)
+        : conninfo_(conninfo), max_batch_(std::max<size_t>(1, max_batch))
+    {
+        for (size_t i = 0; i < std::max<size_t>(1, connections); ++i)
+            workers_.emplace_back(&PGPipeline::worker, this);
+    }
+
+    ~PGPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            stopping_ = true;
         }
+        cv_.notify_all();
+        for (auto &w : workers_)
+            w.join();
+    }
+
+    std::future<DbReply> submit(const char *stmt, std::vector<std::string> params)
+    {
+        Op op{stmt, std::move(params), {}};
+        std::future<DbReply> f = op.done.get_future();
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            queue_.push_back(std::move(op));
+        }
+        cv_.notify_one();
+        return f;
+    }
+};
+
+// Runs a prepared statement through the pipeline when there is one,
+// otherwise as a blocking call on a pooled connection.
+static DbReply run_statement(PGPool &pool, PGPipeline *pipeline, const char *stmt,
+                             std::vector<std::string> params)
+{
+    if (pipeline)
+        return pipeline->submit(stmt, std::move(params)).get();
+
+    std::vector<const char *> values;
+    for (auto &p : params)
+        values.push_back(p.c_str());
+    return pool.exec(stmt, (int)values.size(), values.data());
+}
+
+// Renders values as a Postgres array literal, e.g. {"1","2"}, for
+// binding a whole batch to one $n parameter.
+static std::string pg_array_literal(const std::vector<std::string> &items)
+{
+    std::string out = "{";
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        if (i)
+            out += ',';
+        out += '"';
+        for (char ch : items[i])
+        {
+            if (ch == '"' || ch == '\\')
+                out += '\\';
+            out += ch;
+        }
+        out += '"';
+    }
+    out += '}';
+    return out;
+}
+
+// kv_store.k is INTEGER; batched writes cast the whole key array at once,
+// so keys are checked up front instead of failing a batch later.
+static bool is_int_key(const std::string &key)
+{
+    if (key.empty() || key.size() > 11)
+        return false;
+    size_t i = (key[0] == '-') ? 1 : 0;
+    if (i == key.size())
+        return false;
+    for (; i < key.size(); ++i)
+        if (key[i] < '0' || key[i] > '9')
+            return false;
+    long long v = std::stoll(key);
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+// The row an integer key names, spelled one way: "07" and "-0" become
+// "7" and "0". Other keys are returned unchanged.
+static std::string canonical_key(const std::string &key)
+{
+    return is_int_key(key) ? std::to_string(std::stoll(key)) : key;
+}
+
+// Runs a prepared statement on `c`; returns false with `err` set.
+static bool run_prepared(PGconn *c, const char *stmt, const std::vector<std::string> &params, std::string &err)
+{
+    std::vector<const char *> values;
+    for (auto &p : params)
+        values.push_back(p.c_str());
+    DbReply r = make_reply(c, PQexecPrepared(c, stmt, (int)values.size(), values.data(), nullptr, nullptr, 0));
+    if (!r.ok())
+        err = r.error;
+    return r.ok();
+}
+
+// One row of a batched write
+struct BatchWrite
+{
+    bool del;
+    const std::string *key;
+    const std::string *value;
+};
+
+/**
+ *  Applies `writes` on `c` with the prepared kv_mput and kv_mdel, inside
+ *  the caller's transaction. Writes are first deduplicated by integer
+ *  key, the last one winning: one statement may not touch a row twice,
+ *  and "7" and "07" name the same row. The remaining puts and deletes
+ *  are disjoint, so their order doesn't matter. Returns false with `err`
+ *  set, including for a key that is not an integer.
+ */
+static bool apply_writes(PGconn *c, const std::vector<BatchWrite> &writes, std::string &err)
+{
+    std::unordered_map<long long, const BatchWrite *> last;
+    for (auto &w : writes)
+    {
+        if (!is_int_key(*w.key))
+        {
+            err = "invalid key " + *w.key;
+            return false;
+        }
+        last[std::stoll(*w.key)] = &w;
+    }
+    std::vector<std::string> put_keys, put_values, del_keys;
+    for (auto &kv : last)
+    {
+        if (kv.second->del)
+            del_keys.push_back(std::to_string(kv.first));
+        else
+        {
+            put_keys.push_back(std::to_string(kv.first));
+            put_values.push_back(*kv.second->value);
+        }
+    }
+    return (put_keys.empty() ||
+            run_prepared(c, "kv_mput", {pg_array_literal(put_keys), pg_array_literal(put_values)}, err)) &&
+           (del_keys.empty() || run_prepared(c, "kv_mdel", {pg_array_literal(del_keys)}, err));
+}
+
+// ---------- WriteBehindQueue ----------
+struct PendingWrite
+{
+    bool del;
+    std::string key;
+    std::string value;
+};
+
+struct WriteBehindConfig
+{
+    size_t flush_ms = WB_FLUSH_MS;
+    size_t batch_max = WB_BATCH_MAX;
+    std::string journal = WB_JOURNAL;
+    size_t max_pending = WB_MAX_PENDING;
+};
+
+/**
+ *  Write-behind (write-back) queue for PUT/DELETE.
+ *
+ *  Writes are acknowledged once they are in the cache and appended to
+ *  this queue. Pending writes are coalesced per key: only the last value
+ *  written before a flush reaches Postgres, and a DELETE replaces a
+ *  pending PUT. A flusher thread commits them every `flush_ms`, or as
+ *  soon as `batch_max` keys are waiting, as one transaction of at most
+ *  two statements: an INSERT ... SELECT unnest(...) ON CONFLICT upsert
+ *  for the PUTs and a DELETE ... WHERE k = ANY($1) for the DELETEs.
+ *
+ *  Durability: every write is also appended to a journal file and
+ *  flushed to the OS before it is acknowledged, so a crash of kv_server
+ *  loses nothing; the journal is fdatasync'd on every flush tick, which
+ *  bounds what a power loss can take to one `flush_ms` window. The
+ *  journal is replayed on startup and rotated away once its writes are
+ *  committed. The sync runs outside the queue lock, so writers never
+ *  wait on the disk.
+ *
+ *  Backpressure: while Postgres is unreachable pending writes pile up;
+ *  once `max_pending` keys wait, writes to further keys are refused
+ *  (enqueue returns false) until a flush gets through.
+ */
+class WriteBehindQueue
+{
+private:
+    PGPool &pool_;
+    WriteBehindConfig config_;
+
+    // Newest write per key; also serves read-your-writes lookups
+    std::unordered_map<std::string, PendingWrite> pending_;
+    // The batch being committed; kept until the commit succeeds
+    std::unordered_map<std::string, PendingWrite> inflight_;
+
+    FILE *journal_ = nullptr;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::thread flusher_;
+
+    std::atomic<uint64_t> flushed_batches_{0};
+    std::atomic<uint64_t> flushed_rows_{0};
+    std::atomic<uint64_t> failed_flushes_{0};
+    std::atomic<uint64_t> accepted_writes_{0};
+    std::atomic<uint64_t> coalesced_writes_{0};
+    std::atomic<uint64_t> cancelled_puts_{0};
+    std::atomic<uint64_t> rejected_writes_{0};
+
+    bool full_locked() const
+    {
+        return config_.max_pending && pending_.size() >= config_.max_pending;
+    }
+
+    // Journals and coalesces one accepted write; the caller flushes the
+    // journal to the OS before acknowledging.
+    void add_locked(PendingWrite w)
+    {
+        if (journal_)
+            journal_append(journal_, w);
+        accepted_writes_++;
+        coalesce(std::move(w));
+    }
+
+    std::string flushing_path() const { return config_.journal + ".flushing"; }
+
+    static void journal_append(FILE *f, const PendingWrite &w)
+    {
+        if (w.del)
+            fprintf(f, "D %zu\n", w.key.size());
+        else
+            fprintf(f, "P %zu %zu\n", w.key.size(), w.value.size());
+        fwrite(w.key.data(), 1, w.key.size(), f);
+        fwrite(w.value.data(), 1, w.value.size(), f);
+        fputc('\n', f);
+    }
+
+    static void journal_read(const std::string &path, std::vector<PendingWrite> &out)
+    {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f)
+            return;
+        char op;
+        size_t klen, vlen = 0;
+        while (fscanf(f, " %c %zu", &op, &klen) == 2)
+        {
+            vlen = 0;
+            if (op == 'P' && fscanf(f, " %zu", &vlen) != 1)
+                break;
+            if (fgetc(f) != '\n')
+                break;
+            PendingWrite w{op == 'D', std::string(klen, '\0'), std::string(vlen, '\0')};
+            if (fread(&w.key[0], 1, klen, f) != klen || fread(&w.value[0], 1, vlen, f) != vlen ||
+                fgetc(f) != '\n')
+                break; // torn tail from a crash mid-append
+            out.push_back(std::move(w));
+        }
+        fclose(f);
+    }
+
+    // Folds a write into pending_; returns false if it replaced an
+    // older pending write for the same row. Keys are canonicalized, so
+    // every spelling of one integer key coalesces into one entry.
+    bool coalesce(PendingWrite w)
+    {
+        w.key = canonical_key(w.key);
+        auto it = pending_.find(w.key);
+        if (it == pending_.end())
+        {
+            std::string key = w.key;
+            pending_.emplace(std::move(key), std::move(w));
+            return true;
+        }
+        if (w.del && !it->second.del)
+            cancelled_puts_++;
+        coalesced_writes_++;
+        it->second = std::move(w);
+        return false;
+    }
+
+    // Restores writes acknowledged before a crash, rewriting them into a
+    // fresh journal so the rotation below can't overwrite them.
+    void replay_journal()
+    {
+        std::vector<PendingWrite> replay;
+        journal_read(flushing_path(), replay);
+        journal_read(config_.journal, replay);
+
+        std::string tmp = config_.journal + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            throw std::runtime_error("Cannot open write-behind journal " + tmp);
+        for (auto &w : replay)
+            journal_append(f, w);
+        fflush(f);
+        fdatasync(fileno(f));
+        fclose(f);
+        std::rename(tmp.c_str(), config_.journal.c_str());
+        std::remove(flushing_path().c_str());
+
+        size_t replayed = replay.size();
+        for (auto &w : replay)
+            coalesce(std::move(w));
+        if (replayed)
+            std::cout << "Write-behind: replaying " << replayed << " journaled writes ("
+                      << pending_.size() << " keys)\n";
+
+        journal_ = fopen(config_.journal.c_str(), "ab");
+        if (!journal_)
+            throw std::runtime_error("Cannot open write-behind journal " + config_.journal);
+    }
+
+    using Batch = std::unordered_map<std::string, PendingWrite>;
+
+    // Upserts every PUT and deletes every DELETE in `batch`.
+    static bool apply(PGconn *c, const Batch &batch, std::string &err)
+    {
+        std::vector<BatchWrite> writes;
+        writes.reserve(batch.size());
+        for (auto &kv : batch)
+            writes.push_back(BatchWrite{kv.second.del, &kv.second.key, &kv.second.value});
+        return apply_writes(c, writes, err);
+    }
+
+    // Commits a batch as one transaction.
+    bool flush(const Batch &batch)
+    {
+        PGconn *c = pool_.acquire();
+        if (!c)
+        {
+            std::cerr << "Write-behind flush postponed: no database connection" << std::endl;
+            return false;
+        }
+        std::string err;
+        bool ok = run_in_transaction(c, [&](std::string &e)
+                                     { return apply(c, batch, e); }, err);
+        if (!ok)
+            std::cerr << "Write-behind flush of " << batch.size() << " writes failed: " << err << std::endl;
+        pool_.release(c);
+        return ok;
+    }
+
+    // After repeated batch failures, applies writes one at a time so a
+    // single bad row (e.g. a non-integer key) can't wedge the queue.
+    // Returns false, keeping the batch, if the database itself is down;
+    // rows already applied are simply re-applied on the retry.
+    bool flush_individually(const Batch &batch)
+    {
+        for (auto it = batch.begin(); it != batch.end(); ++it)
+        {
+            PGconn *c = pool_.acquire();
+            if (!c)
+                return false;
+            std::string err;
+            bool ok = apply(c, Batch{*it}, err);
+            bool alive = PQstatus(c) == CONNECTION_OK;
+            pool_.release(c);
+            if (!ok && !alive)
+                return false;
+            if (!ok)
+                std::cerr << "Write-behind: dropping write for key " << it->first << ": " << err << std::endl;
+        }
+        return true;
+    }
+
+    void flusher()
+    {
+        int failures = 0;
+        std::unique_lock<std::mutex> lk(m_);
+        while (true)
+        {
+            cv_.wait_for(lk, std::chrono::milliseconds(config_.flush_ms), [&]
+                         { return stopping_ || pending_.size() >= config_.batch_max; });
+            // enqueue() flushes each append to the OS, so only the sync
+            // is left; only this thread closes the journal, so the fd
+            // stays valid while the lock is dropped
+            if (journal_)
+            {
+                int fd = fileno(journal_);
+                lk.unlock();
+                fdatasync(fd);
+                lk.lock();
+            }
+
+            FILE *rotated = nullptr;
+            if (inflight_.empty())
+            {
+                if (pending_.empty())
+                {
+                    if (stopping_)
+                        break;
+                    continue;
+                }
+                inflight_.swap(pending_);
+                if (journal_)
+                {
+                    // The rotated journal now covers exactly inflight_
+                    rotated = journal_;
+                    std::rename(config_.journal.c_str(), flushing_path().c_str());
+                    journal_ = fopen(config_.journal.c_str(), "ab");
+                }
+            }
+
+            lk.unlock();
+            if (rotated)
+            {
+                // Appends since the sync above are in it too
+                fdatasync(fileno(rotated));
+                fclose(rotated);
+            }
+            bool ok = flush(inflight_);
+            if (!ok && ++failures >= 3)
+                ok = flush_individually(inflight_);
+            lk.lock();
+
+            if (ok)
+            {
+                flushed_batches_++;
+                flushed_rows_ += inflight_.size();
+                inflight_.clear();
+                if (journal_)
+                    std::remove(flushing_path().c_str());
+                failures = 0;
+            }
+            else
+            {
+                failed_flushes_++;
+                if (stopping_)
+                    break;
+            }
+        }
+    }
+
+public:
+    WriteBehindQueue(PGPool &pool, const WriteBehindConfig &config)
+        : pool_(pool), config_(config)
+    {
+        if (!config_.journal.empty() && config_.journal != "none")
+            replay_journal();
+        else
+            config_.journal.clear();
+        flusher_ = std::thread(&WriteBehindQueue::flusher, this);
+    }
+
+    ~WriteBehindQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        flusher_.join();
+        if (journal_)
+            fclose(journal_);
+    }
+
+    // `apply` runs under the queue lock, so concurrent writers to one key
+    // update the cache in the same order they are queued for Postgres.
+    // Returns false, without applying, if the queue is full and `key`
+    // has no pending write to coalesce into.
+    bool enqueue(bool del, const std::string &key, const std::string &value,
+                 const std::function<void()> &apply)
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        if (full_locked() && !pending_.count(canonical_key(key)))
+        {
+            rejected_writes_++;
+            return false;
+        }
+        apply();
+        add_locked(PendingWrite{del, key, value});
+        if (journal_)
+            fflush(journal_);
+        if (pending_.size() >= config_.batch_max)
+            cv_.notify_one();
+        return true;
+    }
+
+    // Queues a whole batch under one lock, calling apply(w) for each
+    // write as enqueue() does. A full queue refuses all of it, so a batch
+    // is never partly accepted (it may overshoot `max_pending` instead).
+    bool enqueue_batch(std::vector<PendingWrite> writes,
+                       const std::function<void(const PendingWrite &)> &apply)
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        if (full_locked())
+        {
+            rejected_writes_ += writes.size();
+            return false;
+        }
+        for (auto &w : writes)
+        {
+            apply(w);
+            add_locked(std::move(w));
+        }
+        if (journal_)
+            fflush(journal_);
+        if (pending_.size() >= config_.batch_max)
+            cv_.notify_one();
+        return true;
+    }
+
+    // Newest not-yet-committed write for `key`, if any. Lets a cache miss
+    // see writes that are acknowledged but not yet in Postgres.
+    bool lookup(const std::string &key, PendingWrite &out)
+    {
+        std::string k = canonical_key(key);
+        std::lock_guard<std::mutex> lk(m_);
+        auto it = pending_.find(k);
+        if (it != pending_.end())
+        {
+            out = it->second;
+            return true;
+        }
+        it = inflight_.find(k);
+        if (it != inflight_.end())
+        {
+            out = it->second;
+            return true;
+        }
+        return false;
+    }
+
+    json stats()
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        return json{{"pending", pending_.size()},
+                    {"inflight", inflight_.size()},
+                    {"flushed_batches", flushed_batches_.load()},
+                    {"flushed_rows", flushed_rows_.load()},
+                    {"failed_flushes", failed_flushes_.load()},
+                    {"accepted_writes", accepted_writes_.load()},
+                    {"coalesced_writes", coalesced_writes_.load()},
+                    {"cancelled_puts", cancelled_puts_.load()},
+                    {"rejected_writes", rejected_writes_.load()}};
+    }
+};
+
+static std::string url_decode(const std::string &s)
+{
+    std::string ret;
+    char ch;
+    int i, ii;
+    for (i = 0; i < (int)s.length(); i++)
+    {
+        if (s[i] == '%')
+        {
+            sscanf(s.substr(i + 1, 2).c_str(), "%x", &ii);
+            ch = static_cast<char>(ii);
+            ret += ch;
+            i = i + 2;
+        }
+        else if (s[i] == '+')
+        {
+            ret += ' ';
+        }
+        else
+        {
+            ret += s[i];
+        }
+    }
+    return ret;
+}
+
+// Reads a numeric setting from the environment, falling back to `def`
+// when the variable is unset or not a valid number.
+static size_t env_size(const char *name, size_t def)
+{
+    const char *env_p = std::getenv(name);
+    if (!env_p || !*env_p)
+        return def;
+    try
+    {
+        return (size_t)std::stoull(env_p);
+    }
+    catch (...)
+    {
+        std::cerr << "Warning: Invalid " << name << " value. Using default (" << def << ").\n";
+        return def;
+    }
+}
+
+static std::string env_string(const char *name, const std::string &def)
+{
+    const char *env_p = std::getenv(name);
+    return (env_p && *env_p) ? std::string(env_p) : def;
+}
+
+// Set from HTTP_KEEP_ALIVE in main(); mirrors civetweb's enable_keep_alive.
+static bool http_keep_alive = false;
+
+// Whether this response may leave the connection open. Must agree with
+// civetweb, which keeps the socket only if keep-alive is enabled and the
+// client didn't ask to close (HTTP/1.0 clients must opt in).
+static bool keep_connection(struct mg_connection *conn)
+{
+    if (!http_keep_alive)
+        return false;
+    const char *hdr = mg_get_header(conn, "Connection");
+    if (hdr)
+        return strcasestr(hdr, "keep-alive") != nullptr;
+    const auto *ri = mg_get_request_info(conn);
+    return ri && ri->http_version && std::string(ri->http_version) == "1.1";
+}
+
+// Appends `n` bytes as a JSON string literal. Bytes >= 0x80 pass through
+// unchanged (values are stored as UTF-8 text).
+static void append_json_string(std::string &out, const char *p, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (size_t i = 0; i < n; ++i)
+    {
+        unsigned char ch = (unsigned char)p[i];
+        switch (ch)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        default:
+            if (ch < 0x20)
+            {
+                out += "\\u00";
+                out += hex[ch >> 4];
+                out += hex[ch & 0xf];
+            }
+            else
+                out += (char)ch;
+        }
+    }
+    out += '"';
+}
+
+// ---------- Response headers ----------
+/**
+ *  Cached "Date:" header line, refreshed once per second by a background
+ *  thread so responses never call time formatting. Off unless started
+ *  (HTTP_DATE_HEADER=yes). The line sits behind a seqlock: a reader
+ *  retries if the refresher wrote it meanwhile, so it never copies a
+ *  torn line. The words are atomics so the racing copy is well defined.
+ */
+class HttpDate
+{
+private:
+    static constexpr size_t WORDS = 8; // 64 bytes
+    std::atomic<uint64_t> words_[WORDS] = {};
+    std::atomic<size_t> len_{0};
+    std::atomic<unsigned> seq_{0}; // odd while a refresh is writing
+    std::atomic<bool> enabled_{false};
+
+    void refresh()
+    {
+        uint64_t buf[WORDS] = {};
+        time_t now = time(nullptr);
+        struct tm gmt;
+        gmtime_r(&now, &gmt);
+        size_t n = strftime(reinterpret_cast<char *>(buf), sizeof(buf), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &gmt);
+
+        unsigned s = seq_.load(std::memory_order_relaxed);
+        seq_.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORDS; ++i)
+            words_[i].store(buf[i], std::memory_order_relaxed);
+        len_.store(n, std::memory_order_relaxed);
+        seq_.store(s + 2, std::memory_order_release);
+    }
+
+public:
+    static HttpDate &instance()
+    {
+        static HttpDate d;
+        return d;
+    }
+
+    void start()
+    {
+        refresh();
+        enabled_ = true;
+        std::thread([this]
+                    {
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                refresh();
+            } })
+            .detach();
+    }
+
+    // Appends the cached line at `out`; returns the bytes written.
+    size_t append(char *out) const
+    {
+        if (!enabled_.load(std::memory_order_relaxed))
+            return 0;
+        uint64_t buf[WORDS];
+        size_t n;
+        unsigned before, after;
+        do
+        {
+            before = seq_.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORDS; ++i)
+                buf[i] = words_[i].load(std::memory_order_relaxed);
+            n = len_.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = seq_.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+        memcpy(out, buf, n);
+        return n;
+    }
+};
+
+static const char *status_reason(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "";
+    }
+}
+
+/**
+ *  Response header blocks precomputed per status code, content type and
+ *  connection disposition. Each ends in "Content-Length: " so a response
+ *  only appends the length digits, the optional Date line and CRLF.
+ */
+class HeaderTemplates
+{
+private:
+    static constexpr int STATUSES[] = {200, 400, 404, 500, 503};
+    static constexpr size_t N = sizeof(STATUSES) / sizeof(STATUSES[0]);
+    std::string blocks_[N][2];
+    std::string content_type_;
+
+    static std::string build(int status, const std::string &content_type, bool keep)
+    {
+        return "HTTP/1.1 " + std::to_string(status) + " " + status_reason(status) + "\r\n" +
+               "Content-Type: " + content_type + "\r\n" +
+               "Connection: " + (keep ? "keep-alive" : "close") + "\r\n" +
+               "Content-Length: ";
+    }
+
+public:
+    explicit HeaderTemplates(const std::string &content_type) : content_type_(content_type)
+    {
+        for (size_t i = 0; i < N; ++i)
+            for (int keep = 0; keep < 2; ++keep)
+                blocks_[i][keep] = build(STATUSES[i], content_type, keep);
+    }
+
+    // Writes the full header block for `body_len` into `out` (which must
+    // have room for a few hundred bytes); returns its length.
+    size_t write(char *out, int status, bool keep, size_t body_len) const
+    {
+        const std::string *block = nullptr;
+        std::string fallback;
+        for (size_t i = 0; i < N; ++i)
+            if (STATUSES[i] == status)
+                block = &blocks_[i][keep];
+        if (!block)
+        {
+            fallback = build(status, content_type_, keep);
+            block = &fallback;
+        }
+
+        char *p = out;
+        memcpy(p, block->data(), block->size());
+        p += block->size();
+        p = std::to_chars(p, p + 20, body_len).ptr;
+        *p++ = '\r';
+        *p++ = '\n';
+        p += HttpDate::instance().append(p);
+        *p++ = '\r';
+        *p++ = '\n';
+        return p - out;
+    }
+};
+
+static const HeaderTemplates json_headers("application/json");
+static const HeaderTemplates octet_headers("application/octet-stream");
+
+/**
+ *  Builds a JSON response ({"k":"v",...}, with optional nested objects
+ *  and string arrays) plus its headers in a per-thread buffer that is
+ *  reused across requests, then sends it with a single mg_write. The
+ *  body is written after a reserved gap and the precomputed header block
+ *  is copied into the gap once Content-Length is known, so nothing is
+ *  copied or allocated on the steady-state path.
+ */
+class JsonResponse
+{
+private:
+    static constexpr size_t HEADER_ROOM = 256;
+    // Buffers that grew past this (huge values) are released after use
+    static constexpr size_t KEEP_CAPACITY = 1 << 20;
+
+    std::string &buf_;
+    int status_;
+    bool raw_ = false;
+    // False right after an opening brace or bracket
+    bool need_comma_ = false;
+
+    static std::string &thread_buffer()
+    {
+        thread_local std::string buf;
+        return buf;
+    }
+
+    void separator()
+    {
+        if (need_comma_)
+            buf_ += ',';
+        need_comma_ = true;
+    }
+
+public:
+    explicit JsonResponse(int status) : buf_(thread_buffer()), status_(status)
+    {
+        buf_.assign(HEADER_ROOM, ' ');
+        buf_ += '{';
+    }
+
+    JsonResponse &field(const char *name, const char *value, size_t len)
+    {
+        separator();
+        append_json_string(buf_, name, strlen(name));
+        buf_ += ':';
+        append_json_string(buf_, value, len);
+        return *this;
+    }
+
+    JsonResponse &field(const char *name, const std::string &value)
+    {
+        return field(name, value.data(), value.size());
+    }
+
+    JsonResponse &field(const char *name, const char *value)
+    {
+        return field(name, value, strlen(value));
+    }
+
+    // Starts a nested object ('{') or array ('[') under `name`; close it
+    // with end().
+    JsonResponse &begin(const char *name, char bracket)
+    {
+        separator();
+        append_json_string(buf_, name, strlen(name));
+        buf_ += ':';
+        buf_ += bracket;
+        need_comma_ = false;
+        return *this;
+    }
+
+    JsonResponse &end(char bracket)
+    {
+        buf_ += bracket;
+        need_comma_ = true;
+        return *this;
+    }
+
+    // Appends a string element to the array opened by begin().
+    JsonResponse &element(const std::string &value)
+    {
+        separator();
+        append_json_string(buf_, value.data(), value.size());
+        return *this;
+    }
+
+    // Replaces the body with an already-serialized JSON document.
+    JsonResponse &body(const std::string &json_text)
+    {
+        buf_.resize(HEADER_ROOM);
+        buf_ += json_text;
+        raw_ = true;
+        return *this;
+    }
+
+    void send(struct mg_connection *conn)
+    {
+        if (!raw_)
+            buf_ += '}';
+        size_t body_len = buf_.size() - HEADER_ROOM;
+        char hdr[HEADER_ROOM];
+        size_t n = json_headers.write(hdr, status_, keep_connection(conn), body_len);
+        char *start = &buf_[HEADER_ROOM - n];
+        memcpy(start, hdr, n);
+        mg_write(conn, start, n + body_len);
+        if (buf_.capacity() > KEEP_CAPACITY)
+            std::string().swap(buf_);
+    }
+};
+
+static void send_json(struct mg_connection *conn, int status, const json &j)
+{
+    JsonResponse(status).body(j.dump()).send(conn);
+}
+
+// Sends `len` bytes as an application/octet-stream body. Headers and body
+// are copied into one per-thread buffer so they go out in a single write.
+static void send_octets(struct mg_connection *conn, int status, const char *data, size_t len)
+{
+    static constexpr size_t HEADER_ROOM = 256;
+    static constexpr size_t KEEP_CAPACITY = 1 << 20;
+    thread_local std::string buf;
+    buf.resize(HEADER_ROOM + len);
+    size_t n = octet_headers.write(&buf[0], status, keep_connection(conn), len);
+    memcpy(&buf[n], data, len);
+    mg_write(conn, buf.data(), n + len);
+    if (buf.capacity() > KEEP_CAPACITY)
+        std::string().swap(buf);
+}
+
+/**
+ *  Writes a response body with chunked transfer encoding, so its length
+ *  need not be known up front. The headers go out with the first chunk.
+ */
+class ChunkedResponse
+{
+private:
+    struct mg_connection *conn_;
+    std::string headers_;
+    bool ok_ = true;
+
+    void put(const char *data, size_t len)
+    {
+        if (ok_ && mg_write(conn_, data, len) != (int)len)
+            ok_ = false;
+    }
+
+public:
+    ChunkedResponse(struct mg_connection *conn, int status, const char *content_type) : conn_(conn)
+    {
+        headers_ = "HTTP/1.1 " + std::to_string(status) + " " + status_reason(status) + "\r\n" +
+                   "Content-Type: " + content_type + "\r\n" +
+                   "Transfer-Encoding: chunked\r\n" +
+                   "Connection: " + (keep_connection(conn) ? "keep-alive" : "close") + "\r\n";
+        char date[64];
+        headers_.append(date, HttpDate::instance().append(date));
+        headers_ += "\r\n";
+    }
+
+    // Sends `data` as one chunk; returns false once the client is gone.
+    bool chunk(const std::string &data)
+    {
+        if (data.empty())
+            return ok_;
+        char size[24];
+        int n = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+        std::string out;
+        out.reserve(headers_.size() + n + data.size() + 2);
+        out.swap(headers_);
+        out.append(size, n).append(data).append("\r\n");
+        put(out.data(), out.size());
+        return ok_;
+    }
+
+    // Sends the terminating zero-length chunk.
+    void finish()
+    {
+        std::string out;
+        out.swap(headers_);
+        out += "0\r\n\r\n";
+        put(out.data(), out.size());
+    }
+};
+
+// True when the request header `name` mentions `needle`.
+static bool header_has(struct mg_connection *conn, const char *name, const char *needle)
+{
+    const char *v = mg_get_header(conn, name);
+    return v && strstr(v, needle);
+}
+
+// ---------- Request bodies ----------
+/**
+ *  Free list of fixed-size body blocks shared by all request threads, so
+ *  reading a body never reallocates or copies as it grows.
+ */
+class BlockPool
+{
+private:
+    // Blocks beyond this stay unpooled and are simply freed
+    static constexpr size_t MAX_FREE = 256;
+    std::mutex mu_;
+    std::vector<std::unique_ptr<char[]>> free_;
+
+public:
+    static BlockPool &instance()
+    {
+        static BlockPool p;
+        return p;
+    }
+
+    std::unique_ptr<char[]> get()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (!free_.empty())
+            {
+                auto b = std::move(free_.back());
+                free_.pop_back();
+                return b;
+            }
+        }
+        return std::unique_ptr<char[]>(new char[BODY_BLOCK_SIZE]);
+    }
+
+    void put(std::unique_ptr<char[]> b)
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (free_.size() < MAX_FREE)
+            free_.push_back(std::move(b));
+    }
+};
+
+/**
+ *  A request body held as a chain of pooled blocks; the blocks go back
+ *  to the pool when the chain is destroyed.
+ */
+class BodyChain
+{
+private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t len;
+    };
+    std::vector<Block> blocks_;
+    size_t size_ = 0;
+    bool done_ = false;
+
+public:
+    BodyChain() = default;
+    BodyChain(const BodyChain &) = delete;
+    BodyChain &operator=(const BodyChain &) = delete;
+
+    ~BodyChain()
+    {
+        for (auto &b : blocks_)
+            BlockPool::instance().put(std::move(b.data));
+    }
+
+    /**
+     *  Reads the body, looping until mg_read reports the end: a single
+     *  read may return short, and chunked bodies have no length. With
+     *  `stop_after` set, stops early once more than that many bytes are
+     *  held (done() then stays false and the rest is still unread).
+     *  Returns false on a read error.
+     */
+    bool read(struct mg_connection *conn, size_t stop_after = 0)
+    {
+        while (!stop_after || size_ <= stop_after)
+        {
+            if (blocks_.empty() || blocks_.back().len == BODY_BLOCK_SIZE)
+                blocks_.push_back(Block{BlockPool::instance().get(), 0});
+            Block &b = blocks_.back();
+            int r = mg_read(conn, b.data.get() + b.len, BODY_BLOCK_SIZE - b.len);
+            if (r < 0)
+                return false;
+            if (r == 0)
+            {
+                done_ = true;
+                return true;
+            }
+            b.len += r;
+            size_ += r;
+        }
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+    // Whether the whole body has been read.
+    bool done() const { return done_; }
+
+    // First byte of the body, or 0 if it is empty.
+    char front() const { return size_ ? blocks_.front().data[0] : 0; }
+
+    // Calls fn(data, len) for each non-empty block in order.
+    template <typename Fn>
+    void for_each(Fn fn) const
+    {
+        for (auto &b : blocks_)
+            if (b.len)
+                fn(b.data.get(), b.len);
+    }
+
+    std::string str() const
+    {
+        std::string out;
+        out.reserve(size_);
+        for_each([&](const char *p, size_t n)
+                 { out.append(p, n); });
+        return out;
+    }
+};
+
+static size_t put_stream_threshold = PUT_STREAM_THRESHOLD;
+
+/**
+ *  Loads rows into kv_store through COPY. Rows in COPY text format
+ *  ("k\tv\n") go into the per-session staging table kv_ingest (created
+ *  by open_pg_connection), which no other session can see. finish()
+ *  merges them with a single upsert and empties the table in one
+ *  transaction, so existing keys are overwritten (the last row per key
+ *  wins) and nothing reaches kv_store before that commit.
+ */
+class CopyUpsert
+{
+private:
+    PGconn *c_;
+    std::string err_;
+    bool copying_ = false;
+    bool ok_;
+
+public:
+    explicit CopyUpsert(PGconn *c) : c_(c)
+    {
+        PGresult *r = PQexec(c_, "COPY kv_ingest (k, v) FROM STDIN");
+        ok_ = PQresultStatus(r) == PGRES_COPY_IN;
+        if (!ok_)
+            err_ = PQerrorMessage(c_);
+        PQclear(r);
+        copying_ = ok_;
+    }
+
+    bool write(const char *data, size_t len)
+    {
+        if (ok_ && len && PQputCopyData(c_, data, (int)len) != 1)
+        {
+            err_ = PQerrorMessage(c_);
+            ok_ = false;
+        }
+        return ok_;
+    }
+
+    // Makes finish() roll back, reporting `why`.
+    void abort(const std::string &why)
+    {
+        if (err_.empty())
+            err_ = why;
+        ok_ = false;
+    }
+
+    // Ends the COPY and merges; leaves kv_store untouched on any failure.
+    bool finish()
+    {
+        if (copying_)
+        {
+            copying_ = false;
+            if (PQputCopyEnd(c_, ok_ ? nullptr : "client aborted the load") != 1)
+                ok_ = false;
+            while (PGresult *r = PQgetResult(c_))
+            {
+                if (PQresultStatus(r) != PGRES_COMMAND_OK)
+                {
+                    if (err_.empty())
+                        err_ = PQerrorMessage(c_);
+                    ok_ = false;
+                }
+                PQclear(r);
+            }
+        }
+        else if (!ok_)
+            return false; // never started
+
+        // A failed COPY loaded nothing; a failed merge leaves its rows
+        // staged, so they are cleared either way
+        const char *merge =
+            "INSERT INTO kv_store(k,v) SELECT DISTINCT ON (k) k, v FROM kv_ingest ORDER BY k, n DESC "
+            "ON CONFLICT(k) DO UPDATE SET v=EXCLUDED.v, updated_at=now()";
+        std::string err;
+        ok_ = ok_ && run_in_transaction(c_, [&](std::string &e)
+                                        { return run_sql(c_, merge, e) && run_sql(c_, "TRUNCATE kv_ingest", e); }, err);
+        if (!ok_)
+        {
+            if (err_.empty())
+                err_ = err;
+            std::string ignored;
+            run_sql(c_, "TRUNCATE kv_ingest", ignored);
+        }
+        return ok_;
+    }
+
+    const std::string &error() const { return err_; }
+};
+
+/**
+ *  Upserts one value through COPY as it arrives, escaping it block by
+ *  block so it is never concatenated in memory.
+ */
+class CopyPut
+{
+private:
+    CopyUpsert copy_;
+    std::string out_;
+
+public:
+    CopyPut(PGconn *c, const std::string &key) : copy_(c)
+    {
+        out_.reserve(BODY_BLOCK_SIZE * 2);
+        out_ = key;
+        out_ += '\t';
+    }
+
+    bool write(const char *p, size_t n)
+    {
+        // COPY text format: backslash, tab, CR and LF must be escaped
+        for (size_t i = 0; i < n; ++i)
+        {
+            switch (p[i])
+            {
+            case '\\': out_ += "\\\\"; break;
+            case '\t': out_ += "\\t"; break;
+            case '\n': out_ += "\\n"; break;
+            case '\r': out_ += "\\r"; break;
+            default: out_ += p[i];
+            }
+        }
+        bool ok = copy_.write(out_.data(), out_.size());
+        out_.clear();
+        return ok;
+    }
+
+    void abort(const std::string &why) { copy_.abort(why); }
+
+    // Ends the row and commits; returns false with error() set on failure.
+    bool finish()
+    {
+        copy_.write("\n", 1);
+        return copy_.finish();
+    }
+
+    const std::string &error() const { return copy_.error(); }
+};
+
+// Decodes one COPY text-format field (\N, i.e. NULL, becomes empty).
+static std::string copy_unescape(const char *p, size_t n)
+{
+    std::string out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (p[i] != '\\' || i + 1 == n)
+        {
+            out += p[i];
+            continue;
+        }
+        switch (p[++i])
+        {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'v': out += '\v'; break;
+        case 'N': break;
+        default: out += p[i];
+        }
+    }
+    return out;
+}
+
+// ---------- Bulk import ----------
+/**
+ *  Streams newline-delimited "key<TAB>value" input (COPY text format, as
+ *  written by COPY kv_store (k, v) TO STDOUT) into kv_store through
+ *  CopyUpsert, logging throughput about once a second. Optionally keeps
+ *  the last `cache_rows` pairs so the caller can pre-populate a cache
+ *  once the load has committed.
+ */
+class BulkImport
+{
+private:
+    CopyUpsert copy_;
+    size_t rows_ = 0;
+    size_t bytes_ = 0;
+    bool line_open_ = false;
+    size_t cache_rows_;
+    std::string partial_;
+    std::deque<std::pair<std::string, std::string>> recent_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last_report_ = start_;
+
+    void keep_line(const char *p, size_t n)
+    {
+        const char *tab = (const char *)memchr(p, '\t', n);
+        if (!tab)
+            return;
+        recent_.emplace_back(copy_unescape(p, tab - p), copy_unescape(tab + 1, p + n - tab - 1));
+        if (recent_.size() > cache_rows_)
+            recent_.pop_front();
+    }
+
+    void collect(const char *data, size_t len)
+    {
+        const char *end = data + len;
+        while (data < end)
+        {
+            const char *nl = (const char *)memchr(data, '\n', end - data);
+            if (!nl)
+            {
+                partial_.append(data, end - data);
+                return;
+            }
+            if (partial_.empty())
+                keep_line(data, nl - data);
+            else
+            {
+                partial_.append(data, nl - data);
+                keep_line(partial_.data(), partial_.size());
+                partial_.clear();
+            }
+            data = nl + 1;
+        }
+    }
+
+public:
+    BulkImport(PGconn *c, size_t cache_rows) : copy_(c), cache_rows_(cache_rows) {}
+
+    bool write(const char *data, size_t len)
+    {
+        if (!len)
+            return true;
+        rows_ += std::count(data, data + len, '\n');
+        bytes_ += len;
+        line_open_ = data[len - 1] != '\n';
+        if (cache_rows_)
+            collect(data, len);
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_report_ >= std::chrono::seconds(1))
+        {
+            last_report_ = now;
+            std::cout << "Import: " << rows_ << " rows, " << bytes_ / (1024 * 1024) << " MiB, "
+                      << (size_t)rows_per_sec() << " rows/s" << std::endl;
+        }
+        return copy_.write(data, len);
+    }
+
+    bool finish()
+    {
+        // Terminate a final line that lacks its newline
+        if (line_open_)
+            write("\n", 1);
+        return copy_.finish();
+    }
+
+    double seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+    double rows_per_sec() const
+    {
+        double s = seconds();
+        return s > 0 ? rows_ / s : 0;
+    }
+
+    size_t rows() const { return rows_; }
+    size_t bytes() const { return bytes_; }
+    const std::string &error() const { return copy_.error(); }
+    std::deque<std::pair<std::string, std::string>> take_recent() { return std::move(recent_); }
+};
+
+/**
+ *  Interface shared by the per-shard eviction policies, so ShardedCache
+ *  can pick one at startup without KVHandler knowing which it got.
+ */
+class CacheShard {
+public:
+    virtual ~CacheShard() = default;
+    virtual void put(const std::string& key, const std::string& value) = 0;
+    // Inserts only if the key is not cached; returns whether it did.
+    virtual bool put_if_absent(const std::string& key, const std::string& value) = 0;
+    virtual bool get(const std::string& key, std::string& value_out) = 0;
+    virtual void erase(const std::string& key) = 0;
+    // Drops every entry (e.g. after a bulk import rewrote the table).
+    virtual void clear() = 0;
+
+    // Current usage; safe to read without the shard lock.
+    virtual size_t items() const = 0;
+    virtual size_t bytes() const = 0;
+};
+
+struct CacheConfig {
+    size_t max_items = CACHE_MAX_ITEMS;
+    size_t max_bytes = CACHE_MAX_BYTES;
+    size_t shards = CACHE_DEFAULT_SHARDS;
+    std::string policy = CACHE_DEFAULT_POLICY;
+    size_t negative_max_items = NEG_CACHE_MAX_ITEMS;
+    size_t negative_ttl_ms = NEG_CACHE_TTL_MS;
+    size_t warmup_slices = CACHE_WARMUP_SLICES;
+};
+
+// What one entry is charged against the byte budget.
+static size_t cache_entry_bytes(const std::string& key, const std::string& value)
+{
+    return key.size() + value.size() + CACHE_ENTRY_OVERHEAD;
+}
+
+/**
+ *  Unsynchronized LRU index used inside a cache shard.
+ *
+ *  Entries live in one contiguous slab (std::vector) and are linked into
+ *  the LRU order by 32-bit indices instead of list nodes. Lookups go
+ *  through a Robin Hood open-addressing table of {entry index, hash}
+ *  buckets, so a hit is one hash, a short linear probe and one slab
+ *  access. Keys that fit std::string's small-buffer (every INTEGER key
+ *  does) are stored inline in the entry with no separate allocation.
+ */
+class LruTable {
+public:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct Entry {
+        std::string key;
+        std::string value;
+        uint32_t hash = 0;
+        uint32_t prev = NIL; // towards MRU
+        uint32_t next = NIL; // towards LRU
+    };
+
+private:
+    struct Bucket {
+        uint32_t entry = NIL;
+        uint32_t hash = 0;
+    };
+
+    std::vector<Entry> slab_;
+    std::vector<uint32_t> free_;
+    std::vector<Bucket> buckets_;
+    size_t mask_ = 0;
+    int shift_ = 32;
+    uint32_t head_ = NIL; // MRU
+    uint32_t tail_ = NIL; // LRU
+    size_t size_ = 0;
+
+    static uint32_t hash_of(const std::string& key) {
+        // Fibonacci mixing: the shard already consumed the low bits of
+        // std::hash, so spread the whole value before taking the top bits.
+        uint64_t h = std::hash<std::string>{}(key);
+        return (uint32_t)((h * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    size_t home_of(uint32_t hash) const {
+        return hash >> shift_;
+    }
+
+    size_t distance(size_t pos, uint32_t hash) const {
+        return (pos - home_of(hash)) & mask_;
+    }
+
+    void alloc_buckets(size_t expected) {
+        // Keep the load factor under 7/8
+        size_t n = 8;
+        while (n * 7 / 8 < expected + 1) {
+            n <<= 1;
+        }
+        buckets_.assign(n, Bucket{});
+        mask_ = n - 1;
+        shift_ = 32;
+        for (size_t b = n; b > 1; b >>= 1) {
+            --shift_;
+        }
+    }
+
+    void bucket_insert(uint32_t idx, uint32_t hash) {
+        Bucket carry{idx, hash};
+        size_t pos = home_of(hash);
+        size_t dist = 0;
+        while (true) {
+            Bucket& b = buckets_[pos];
+            if (b.entry == NIL) {
+                b = carry;
+                return;
+            }
+            // Robin Hood: the entry further from home keeps the bucket
+            size_t existing = distance(pos, b.hash);
+            if (existing < dist) {
+                std::swap(b, carry);
+                dist = existing;
+            }
+            pos = (pos + 1) & mask_;
+            ++dist;
+        }
+    }
+
+    size_t bucket_find(const std::string& key, uint32_t hash) const {
+        size_t pos = home_of(hash);
+        for (size_t dist = 0;; ++dist) {
+            const Bucket& b = buckets_[pos];
+            if (b.entry == NIL || distance(pos, b.hash) < dist) {
+                return SIZE_MAX;
+            }
+            if (b.hash == hash && slab_[b.entry].key == key) {
+                return pos;
+            }
+            pos = (pos + 1) & mask_;
+        }
+    }
+
+    void bucket_erase(size_t pos) {
+        // Backward-shift deletion keeps probe sequences tombstone-free
+        size_t next = (pos + 1) & mask_;
+        while (buckets_[next].entry != NIL && distance(next, buckets_[next].hash) != 0) {
+            buckets_[pos] = buckets_[next];
+            pos = next;
+            next = (next + 1) & mask_;
+        }
+        buckets_[pos] = Bucket{};
+    }
+
+    void grow() {
+        alloc_buckets(buckets_.size());
+        for (uint32_t i = head_; i != NIL; i = slab_[i].next) {
+            bucket_insert(i, slab_[i].hash);
+        }
+    }
+
+    void link_front(uint32_t idx) {
+        Entry& e = slab_[idx];
+        e.prev = NIL;
+        e.next = head_;
+        if (head_ != NIL) {
+            slab_[head_].prev = idx;
+        }
+        head_ = idx;
+        if (tail_ == NIL) {
+            tail_ = idx;
+        }
+    }
+
+    void unlink(uint32_t idx) {
+        Entry& e = slab_[idx];
+        if (e.prev != NIL) {
+            slab_[e.prev].next = e.next;
+        } else {
+            head_ = e.next;
+        }
+        if (e.next != NIL) {
+            slab_[e.next].prev = e.prev;
+        } else {
+            tail_ = e.prev;
+        }
+    }
+
+public:
+    explicit LruTable(size_t expected) {
+        slab_.reserve(expected);
+        alloc_buckets(expected);
+    }
+
+    size_t size() const { return size_; }
+    uint32_t lru() const { return tail_; }
+    Entry& at(uint32_t idx) { return slab_[idx]; }
+
+    // Returns the entry index for `key`, or NIL.
+    uint32_t find(const std::string& key) const {
+        size_t pos = bucket_find(key, hash_of(key));
+        return pos == SIZE_MAX ? NIL : buckets_[pos].entry;
+    }
+
+    // Moves an entry to the MRU position.
+    void touch(uint32_t idx) {
+        if (idx != head_) {
+            unlink(idx);
+            link_front(idx);
+        }
+    }
+
+    // Inserts a key that is known to be absent, at the MRU position.
+    uint32_t insert(std::string key, std::string value) {
+        if ((size_ + 1) > buckets_.size() * 7 / 8) {
+            grow();
+        }
+        uint32_t idx;
+        if (!free_.empty()) {
+            idx = free_.back();
+            free_.pop_back();
+        } else {
+            idx = (uint32_t)slab_.size();
+            slab_.emplace_back();
+        }
+        Entry& e = slab_[idx];
+        e.hash = hash_of(key);
+        e.key = std::move(key);
+        e.value = std::move(value);
+        bucket_insert(idx, e.hash);
+        link_front(idx);
+        ++size_;
+        return idx;
+    }
+
+    void remove(uint32_t idx) {
+        Entry& e = slab_[idx];
+        bucket_erase(bucket_find(e.key, e.hash));
+        unlink(idx);
+        // Drop the storage but keep the slot for reuse
+        std::string().swap(e.key);
+        std::string().swap(e.value);
+        free_.push_back(idx);
+        --size_;
+    }
+
+    // Like remove(), but moves the key and value out so the entry can be
+    // re-inserted elsewhere without copying.
+    void take(uint32_t idx, std::string& key_out, std::string& value_out) {
+        Entry& e = slab_[idx];
+        bucket_erase(bucket_find(e.key, e.hash));
+        unlink(idx);
+        key_out = std::move(e.key);
+        value_out = std::move(e.value);
+        e.key.clear();
+        e.value.clear();
+        free_.push_back(idx);
+        --size_;
+    }
+};
+
+class LRUCache : public CacheShard {
+private:
+    // Slab of entries + open-addressing index; see LruTable.
+    LruTable table_;
+
+    size_t max_size_;
+    size_t max_bytes_;
+    std::atomic<size_t> bytes_{0};
+    std::atomic<size_t> items_{0};
+    std::mutex cache_mutex_;
+
+    void remove_entry(uint32_t idx) {
+        LruTable::Entry& e = table_.at(idx);
+        bytes_ -= cache_entry_bytes(e.key, e.value);
+        table_.remove(idx);
+        --items_;
+    }
+
+    void evict_lru() {
+        remove_entry(table_.lru());
+    }
+
+public:
+    // A limit of 0 means "unbounded" for that dimension.
+    LRUCache(size_t max_size, size_t max_bytes = 0)
+        : table_(std::min<size_t>(max_size ? max_size : 1024, 1 << 20)),
+          max_size_(max_size ? max_size : SIZE_MAX),
+          max_bytes_(max_bytes ? max_bytes : SIZE_MAX) {}
+
+    size_t items() const override { return items_.load(std::memory_order_relaxed); }
+    size_t bytes() const override { return bytes_.load(std::memory_order_relaxed); }
+
+    void put(const std::string& key, const std::string& value) override {
+        store(key, value, true);
+    }
+
+    bool put_if_absent(const std::string& key, const std::string& value) override {
+        return store(key, value, false);
+    }
+
+private:
+    // Shared body of put (overwrite) and put_if_absent.
+    bool store(const std::string& key, const std::string& value, bool overwrite) {
+        std::scoped_lock lock(cache_mutex_);
+
+        uint32_t idx = table_.find(key);
+        if (idx != LruTable::NIL && !overwrite) {
+            return false;
+        }
+        size_t need = cache_entry_bytes(key, value);
+
+        // A value larger than the whole budget is never cached; drop any
+        // older copy so readers can't see a stale value.
+        if (need > max_bytes_) {
+            if (idx != LruTable::NIL) {
+                remove_entry(idx);
+            }
+            return false;
+        }
+
+        // Case 1: Key already in cache. Update value and move to front (MRU).
+        if (idx != LruTable::NIL) {
+            std::string& old = table_.at(idx).value;
+            bytes_ += need - cache_entry_bytes(key, old);
+            old = value;
+            table_.touch(idx);
+            // The entry is MRU and fits the budget on its own, so this
+            // never evicts the entry just written.
+            while (bytes_ > max_bytes_) {
+                evict_lru();
+            }
+            return true;
+        }
+
+        // Case 2: Key is new.
+        // Evict LRU items (at the back of the list) *before* inserting
+        // until both the item and the byte limits have room.
+        while (table_.size() > 0 &&
+               (table_.size() >= max_size_ || bytes_ + need > max_bytes_)) {
+            evict_lru();
+        }
+
+        // Add the new item to the front (MRU)
+        table_.insert(key, value);
+        bytes_ += need;
+        ++items_;
+        return true;
+    }
+
+public:
+
+    
+    bool get(const std::string& key, std::string& value_out) override {
+        std::scoped_lock lock(cache_mutex_);
+
+        uint32_t idx = table_.find(key);
+
+        // Case 1: Key not found (MISS)
+        if (idx == LruTable::NIL) {
+            return false;
+        }
+
+        // Case 2: Key found (HIT)
+        // Move the accessed item to the front (MRU)
+        table_.touch(idx);
+        // Copy the value to the output parameter
+        value_out = table_.at(idx).value;
+        return true;
+    }
+
+    /**
+     *  Erases a key from the cache.
+     */
+    void erase(const std::string& key) override {
+        std::scoped_lock lock(cache_mutex_);
+
+        uint32_t idx = table_.find(key);
+        if (idx != LruTable::NIL) {
+            remove_entry(idx);
+        }
+    }
+
+    void clear() override {
+        std::scoped_lock lock(cache_mutex_);
+        while (items_ > 0) {
+            evict_lru();
+        }
+    }
+};
+
+/**
+ *  CLOCK (second-chance) cache over a flat slot array.
+ *  A hit only sets the slot's reference bit under a *shared* lock, so
+ *  concurrent readers never block each other and never touch a list.
+ *  Writers take the exclusive lock and sweep the clock hand to evict.
+ */
+class ClockCache : public CacheShard {
+private:
+    struct Slot {
+        std::string key;
+        std::string value;
+        std::atomic<bool> referenced{false};
+        bool used = false;
+    };
+
+    // std::deque so slots never move when the array grows (std::atomic
+    // is not movable) and existing indices stay valid.
+    std::deque<Slot> slots_;
+    std::unordered_map<std::string, size_t> index_;
+    std::vector<size_t> free_slots_;
+    size_t hand_ = 0;
+    size_t max_size_;
+    size_t max_bytes_;
+    std::atomic<size_t> bytes_{0};
+    std::atomic<size_t> items_{0};
+    std::shared_mutex cache_mutex_;
+
+    void release_slot(size_t at) {
+        Slot& s = slots_[at];
+        bytes_ -= cache_entry_bytes(s.key, s.value);
+        --items_;
+        index_.erase(s.key);
+        s.used = false;
+        s.referenced.store(false, std::memory_order_relaxed);
+        std::string().swap(s.key);
+        std::string().swap(s.value);
+        free_slots_.push_back(at);
+    }
+
+    // Advance the hand until a used slot without its reference bit is
+    // found, clearing bits on the way (the "second chance"), and free it.
+    void evict_one() {
+        while (true) {
+            Slot& s = slots_[hand_];
+            size_t at = hand_;
+            hand_ = (hand_ + 1) % slots_.size();
+            if (s.used && !s.referenced.exchange(false, std::memory_order_relaxed)) {
+                release_slot(at);
+                return;
+            }
+        }
+    }
+
+public:
+    // A limit of 0 means "unbounded" for that dimension.
+    ClockCache(size_t max_size, size_t max_bytes = 0)
+        : max_size_(max_size ? max_size : SIZE_MAX),
+          max_bytes_(max_bytes ? max_bytes : SIZE_MAX) {}
+
+    size_t items() const override { return items_.load(std::memory_order_relaxed); }
+    size_t bytes() const override { return bytes_.load(std::memory_order_relaxed); }
+
+    void put(const std::string& key, const std::string& value) override {
+        store(key, value, true);
+    }
+
+    bool put_if_absent(const std::string& key, const std::string& value) override {
+        return store(key, value, false);
+    }
+
+private:
+    // Shared body of put (overwrite) and put_if_absent.
+    bool store(const std::string& key, const std::string& value, bool overwrite) {
+        std::unique_lock lock(cache_mutex_);
+
+        auto it = index_.find(key);
+        if (it != index_.end() && !overwrite) {
+            return false;
+        }
+        size_t need = cache_entry_bytes(key, value);
+
+        if (need > max_bytes_) {
+            if (it != index_.end()) {
+                release_slot(it->second);
+            }
+            return false;
+        }
+
+        if (it != index_.end()) {
+            Slot& s = slots_[it->second];
+            bytes_ += need - cache_entry_bytes(s.key, s.value);
+            s.value = value;
+            s.referenced.store(true, std::memory_order_relaxed);
+            // Referenced, so the sweep passes over it at least once
+            while (bytes_ > max_bytes_ && items_ > 1) {
+                evict_one();
+            }
+            return true;
+        }
+
+        while (items_ > 0 && (items_ >= max_size_ || bytes_ + need > max_bytes_)) {
+            evict_one();
+        }
+
+        size_t at;
+        if (!free_slots_.empty()) {
+            at = free_slots_.back();
+            free_slots_.pop_back();
+        } else {
+            at = slots_.size();
+            slots_.emplace_back();
+        }
+
+        Slot& s = slots_[at];
+        s.key = key;
+        s.value = value;
+        s.used = true;
+        // New entries start unreferenced, so a one-off insert is the first
+        // thing the hand reclaims.
+        s.referenced.store(false, std::memory_order_relaxed);
+        index_.emplace(key, at);
+        bytes_ += need;
+        ++items_;
+        return true;
+    }
+
+public:
+
+    bool get(const std::string& key, std::string& value_out) override {
+        std::shared_lock lock(cache_mutex_);
+
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return false;
+        }
+        Slot& s = slots_[it->second];
+        // Only test-and-set the bit: avoids bouncing the cache line when
+        // an already-hot entry is read by many threads.
+        if (!s.referenced.load(std::memory_order_relaxed)) {
+            s.referenced.store(true, std::memory_order_relaxed);
+        }
+        value_out = s.value;
+        return true;
+    }
+
+    void erase(const std::string& key) override {
+        std::unique_lock lock(cache_mutex_);
+
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            release_slot(it->second);
+        }
+    }
+
+    void clear() override {
+        std::unique_lock lock(cache_mutex_);
+        for (size_t at = 0; at < slots_.size(); ++at) {
+            if (slots_[at].used) {
+                release_slot(at);
+            }
+        }
+    }
+};
+
+/**
+ *  Count-min sketch of recent access frequencies with 8-bit saturating
+ *  counters. Every `sample_size_` increments all counters are halved, so
+ *  old popularity decays and the sketch follows a shifting hot set.
+ */
+class FrequencySketch {
+private:
+    static constexpr int DEPTH = 4;
+    std::vector<uint8_t> table_;
+    size_t mask_;
+    size_t additions_ = 0;
+    size_t sample_size_;
+
+    size_t index_of(uint64_t h, int row) const {
+        // Double hashing: row i probes h1 + i*h2
+        uint64_t h2 = (h >> 32) | 1;
+        return (size_t)((h + row * h2) * 0x9E3779B97F4A7C15ull >> 17) & mask_;
+    }
+
+public:
+    explicit FrequencySketch(size_t expected_items) {
+        size_t width = 64;
+        while (width < expected_items * 2 && width < (1u << 26)) {
+            width <<= 1;
+        }
+        table_.assign(width * DEPTH, 0);
+        mask_ = width - 1;
+        sample_size_ = std::max<size_t>(expected_items, 64) * 10;
+    }
+
+    void increment(const std::string& key) {
+        uint64_t h = std::hash<std::string>{}(key);
+        for (int row = 0; row < DEPTH; ++row) {
+            uint8_t& c = table_[row * (mask_ + 1) + index_of(h, row)];
+            if (c < UINT8_MAX) {
+                ++c;
+            }
+        }
+        if (++additions_ >= sample_size_) {
+            for (auto& c : table_) {
+                c >>= 1;
+            }
+            additions_ /= 2;
+        }
+    }
+
+    unsigned frequency(const std::string& key) const {
+        uint64_t h = std::hash<std::string>{}(key);
+        unsigned f = UINT8_MAX;
+        for (int row = 0; row < DEPTH; ++row) {
+            f = std::min<unsigned>(f, table_[row * (mask_ + 1) + index_of(h, row)]);
+        }
+        return f;
+    }
+};
+
+/**
+ *  W-TinyLFU: new keys enter a small LRU "window" (1% of the shard);
+ *  entries leaving the window must beat the main region's eviction
+ *  victim on estimated frequency to get in. The main region is a
+ *  segmented LRU (20% probation, 80% protected), so a burst of one-off
+ *  keys (misses of a uniform workload, scans) can no longer flush out
+ *  the hot set.
+ */
+class TinyLfuCache : public CacheShard {
+private:
+    struct Segment {
+        LruTable table;
+        size_t bytes = 0;
+        size_t max_items;
+        size_t max_bytes;
+
+        Segment(size_t items, size_t bytes_limit, size_t expected)
+            : table(expected), max_items(items), max_bytes(bytes_limit) {}
+
+        bool over() const { return table.size() > max_items || bytes > max_bytes; }
+    };
+
+    Segment window_;
+    Segment probation_;
+    Segment protected_;
+    FrequencySketch sketch_;
+    size_t max_items_;
+    size_t max_bytes_;
+    std::atomic<size_t> bytes_{0};
+    std::atomic<size_t> items_{0};
+    std::mutex cache_mutex_;
+
+    // Splits a limit into a share of `percent`, keeping "unbounded" as is.
+    static size_t share(size_t limit, size_t percent) {
+        if (limit == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        return std::max<size_t>(1, limit / 100 * percent + limit % 100 * percent / 100);
+    }
+
+    // Initial table size for a segment holding `percent` of the shard's
+    // items; tables grow, so unbounded shards start small like LRUCache.
+    static size_t presize(size_t max_size, size_t percent) {
+        return max_size ? std::min<size_t>(share(max_size, percent), 1 << 16) : 1024;
+    }
+
+    void insert_into(Segment& seg, std::string key, std::string value) {
+        seg.bytes += cache_entry_bytes(key, value);
+        seg.table.insert(std::move(key), std::move(value));
+    }
+
+    void take_from(Segment& seg, uint32_t idx, std::string& key, std::string& value) {
+        seg.table.take(idx, key, value);
+        seg.bytes -= cache_entry_bytes(key, value);
+    }
+
+    void drop_from(Segment& seg, uint32_t idx) {
+        LruTable::Entry& e = seg.table.at(idx);
+        size_t b = cache_entry_bytes(e.key, e.value);
+        seg.bytes -= b;
+        bytes_ -= b;
+        --items_;
+        seg.table.remove(idx);
+    }
+
+    bool main_has_room(size_t need) const {
+        size_t items = probation_.table.size() + protected_.table.size();
+        size_t bytes = probation_.bytes + protected_.bytes;
+        size_t main_items = max_items_ == SIZE_MAX ? SIZE_MAX : max_items_ - window_.max_items;
+        size_t main_bytes = max_bytes_ == SIZE_MAX ? SIZE_MAX : max_bytes_ - window_.max_bytes;
+        return items < main_items && bytes + need <= main_bytes;
+    }
+
+    // Offers an entry evicted from the window to the main region.
+    void admit(std::string key, std::string value) {
+        size_t need = cache_entry_bytes(key, value);
+        unsigned candidate = sketch_.frequency(key);
+        while (!main_has_room(need)) {
+            Segment& seg = probation_.table.size() ? probation_ : protected_;
+            if (seg.table.size() == 0 ||
+                candidate <= sketch_.frequency(seg.table.at(seg.table.lru()).key)) {
+                // Nothing left to evict, or the resident victim is at
+                // least as popular as the candidate: reject
+                bytes_ -= need;
+                --items_;
+                return;
+            }
+            drop_from(seg, seg.table.lru());
+        }
+        insert_into(probation_, std::move(key), std::move(value));
+    }
+
+    // Drops one LRU entry, probation first. The most recently written
+    // entry is MRU of `keep`, so it is only that segment's LRU when it is
+    // alone there, and is skipped in that case.
+    bool evict_lru(const Segment* keep) {
+        for (Segment* v : {&probation_, &protected_, &window_}) {
+            if (v->table.size() > (v == keep ? 1u : 0u)) {
+                drop_from(*v, v->table.lru());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Keeps protected within its share by demoting its LRU to probation.
+    void rebalance_protected() {
+        while (protected_.over() && protected_.table.size() > 1) {
+            std::string k, v;
+            take_from(protected_, protected_.table.lru(), k, v);
+            insert_into(probation_, std::move(k), std::move(v));
+        }
+    }
+
+public:
+    // A limit of 0 means "unbounded" for that dimension.
+    TinyLfuCache(size_t max_size, size_t max_bytes = 0)
+        : window_(share(max_size ? max_size : SIZE_MAX, 1), share(max_bytes ? max_bytes : SIZE_MAX, 1),
+                  presize(max_size, 1)),
+          // Probation has no limit of its own (main_has_room bounds the
+          // main region); its table starts at its nominal 20% share
+          probation_(SIZE_MAX, SIZE_MAX, presize(max_size, 20)),
+          protected_(share(max_size ? max_size : SIZE_MAX, 79), share(max_bytes ? max_bytes : SIZE_MAX, 79),
+                     presize(max_size, 79)),
+          sketch_(max_size ? max_size : (max_bytes ? max_bytes / (CACHE_ENTRY_OVERHEAD + 128) : 1 << 16)),
+          max_items_(max_size ? max_size : SIZE_MAX),
+          max_bytes_(max_bytes ? max_bytes : SIZE_MAX) {}
+
+    size_t items() const override { return items_.load(std::memory_order_relaxed); }
+    size_t bytes() const override { return bytes_.load(std::memory_order_relaxed); }
+
+    void put(const std::string& key, const std::string& value) override {
+        store(key, value, true);
+    }
+
+    bool put_if_absent(const std::string& key, const std::string& value) override {
+        return store(key, value, false);
+    }
+
+private:
+    // Shared body of put (overwrite) and put_if_absent.
+    bool store(const std::string& key, const std::string& value, bool overwrite) {
+        std::scoped_lock lock(cache_mutex_);
+        sketch_.increment(key);
+
+        size_t need = cache_entry_bytes(key, value);
+        for (Segment* seg : {&window_, &probation_, &protected_}) {
+            uint32_t idx = seg->table.find(key);
+            if (idx == LruTable::NIL) {
+                continue;
+            }
+            if (!overwrite) {
+                return false;
+            }
+            // Existing key: drop it if it no longer fits at all, otherwise
+            // update in place and let the segment shed what doesn't fit.
+            if (need > max_bytes_) {
+                drop_from(*seg, idx);
+                return false;
+            }
+            std::string& old = seg->table.at(idx).value;
+            size_t old_bytes = cache_entry_bytes(key, old);
+            seg->bytes += need - old_bytes;
+            bytes_ += need - old_bytes;
+            old = value;
+            seg->table.touch(idx);
+            while (bytes_ > max_bytes_ && evict_lru(seg)) {
+            }
+            return true;
+        }
+
+        if (need > max_bytes_) {
+            return false;
+        }
+
+        // New key: always enters the window; whatever falls out of the
+        // window goes through admission into the main region.
+        insert_into(window_, key, value);
+        bytes_ += need;
+        ++items_;
+        while (window_.over()) {
+            std::string k, v;
+            take_from(window_, window_.table.lru(), k, v);
+            admit(std::move(k), std::move(v));
+        }
+        // In-place updates can grow the main region past its share
+        while (bytes_ > max_bytes_ && evict_lru(&window_)) {
+        }
+        return true;
+    }
+
+public:
+
+    bool get(const std::string& key, std::string& value_out) override {
+        std::scoped_lock lock(cache_mutex_);
+        // Misses count too: that is how a returning key earns admission
+        sketch_.increment(key);
+
+        uint32_t idx = window_.table.find(key);
+        if (idx != LruTable::NIL) {
+            window_.table.touch(idx);
+            value_out = window_.table.at(idx).value;
+            return true;
+        }
+
+        idx = protected_.table.find(key);
+        if (idx != LruTable::NIL) {
+            protected_.table.touch(idx);
+            value_out = protected_.table.at(idx).value;
+            return true;
+        }
+
+        idx = probation_.table.find(key);
+        if (idx != LruTable::NIL) {
+            // Second hit in main: promote to protected
+            std::string k;
+            take_from(probation_, idx, k, value_out);
+            insert_into(protected_, std::move(k), value_out);
+            rebalance_protected();
+            return true;
+        }
+        return false;
+    }
+
+    void erase(const std::string& key) override {
+        std::scoped_lock lock(cache_mutex_);
+
+        for (Segment* seg : {&window_, &probation_, &protected_}) {
+            uint32_t idx = seg->table.find(key);
+            if (idx != LruTable::NIL) {
+                drop_from(*seg, idx);
+                return;
+            }
+        }
+    }
+
+    void clear() override {
+        std::scoped_lock lock(cache_mutex_);
+        while (evict_lru(nullptr)) {
+        }
+    }
+};
+
+static std::unique_ptr<CacheShard> make_cache_shard(const std::string& policy, size_t max_size, size_t max_bytes)
+{
+    if (policy == "clock") {
+        return std::make_unique<ClockCache>(max_size, max_bytes);
+    }
+    if (policy == "tinylfu") {
+        return std::make_unique<TinyLfuCache>(max_size, max_bytes);
+    }
+    if (policy != "lru") {
+        std::cerr << "Warning: Unknown cache policy '" << policy << "'. Using lru.\n";
+    }
+    return std::make_unique<LRUCache>(max_size, max_bytes);
+}
+
+
+/**
+ *  Lock-striped cache: the key space is split over N independent
+ *  CacheShard instances, each with its own mutex and eviction state, so
+ *  threads touching different keys no longer serialize on one lock. The
+ *  shards' policy (LRU, CLOCK or TinyLFU) is chosen by CACHE_POLICY.
+ */
+class ShardedCache {
+private:
+    // Hit/miss counters kept per shard (one cache line each) so counting
+    // doesn't reintroduce a single contended location.
+    struct alignas(64) ShardCounters {
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+    };
+
+    // Keys written while a fill is running, per shard; see fill()
+    struct alignas(64) FillGuard {
+        std::mutex mu;
+        std::unordered_set<std::string> written;
+    };
+
+    std::vector<std::unique_ptr<CacheShard>> shards_;
+    std::unique_ptr<ShardCounters[]> counters_;
+    std::unique_ptr<FillGuard[]> guards_;
+    std::atomic<bool> filling_{false};
+    size_t mask_;
+    CacheConfig config_;
+
+    // Called before every write to shard `i`: the write is recorded first,
+    // so a fill() racing it either sees the record or is overwritten.
+    void note_write(size_t i, const std::string& key) {
+        if (filling_.load()) {
+            std::scoped_lock lock(guards_[i].mu);
+            guards_[i].written.insert(key);
+        }
+    }
+
+    size_t shard_index(const std::string& key) const {
+        return std::hash<std::string>{}(key) & mask_;
+    }
+
+    CacheShard& shard_for(const std::string& key) {
+        return *shards_[shard_index(key)];
+    }
+
+public:
+    ShardedCache(const CacheConfig& config) : config_(config) {
+        size_t num_shards = config.shards;
+        if (num_shards == 0) {
+            num_shards = std::max(1u, std::thread::hardware_concurrency()) * 4;
+        }
+        // Round up to a power of two so the shard index is a mask, not a modulo
+        size_t n = 1;
+        while (n < num_shards) {
+            n <<= 1;
+        }
+        mask_ = n - 1;
+
+        // Every shard gets an equal slice of both limits (rounded up)
+        size_t per_shard_items = (config.max_items + n - 1) / n;
+        size_t per_shard_bytes = (config.max_bytes + n - 1) / n;
+        shards_.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            shards_.push_back(make_cache_shard(config.policy, per_shard_items, per_shard_bytes));
+        }
+        counters_.reset(new ShardCounters[n]);
+        guards_.reset(new FillGuard[n]);
+    }
+
+    size_t shard_count() const { return shards_.size(); }
+
+    void put(const std::string& key, const std::string& value) {
+        size_t i = shard_index(key);
+        note_write(i, key);
+        shards_[i]->put(key, value);
+    }
+
+    bool put_if_absent(const std::string& key, const std::string& value) {
+        return shard_for(key).put_if_absent(key, value);
+    }
+
+    /**
+     *  Background fills (warm-up) read rows that may be older than what
+     *  live writes have since put or erased. Between begin_fill() and
+     *  end_fill(), fill() inserts a row only if the key is not cached and
+     *  has not been written since begin_fill().
+     */
+    void begin_fill() {
+        filling_ = true;
+    }
+
+    bool fill(const std::string& key, const std::string& value) {
+        size_t i = shard_index(key);
+        std::scoped_lock lock(guards_[i].mu);
+        if (guards_[i].written.count(key)) {
+            return false;
+        }
+        return shards_[i]->put_if_absent(key, value);
+    }
+
+    void end_fill() {
+        filling_ = false;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            std::scoped_lock lock(guards_[i].mu);
+            guards_[i].written.clear();
+        }
+    }
+
+    bool get(const std::string& key, std::string& value_out) {
+        size_t i = shard_index(key);
+        bool hit = shards_[i]->get(key, value_out);
+        (hit ? counters_[i].hits : counters_[i].misses).fetch_add(1, std::memory_order_relaxed);
+        return hit;
+    }
+
+    void erase(const std::string& key) {
+        size_t i = shard_index(key);
+        note_write(i, key);
+        shards_[i]->erase(key);
+    }
+
+    void clear() {
+        for (auto& s : shards_) s->clear();
+    }
+
+    const CacheConfig& config() const { return config_; }
+
+    size_t items() const {
+        size_t n = 0;
+        for (auto& s : shards_) n += s->items();
+        return n;
+    }
+
+    size_t bytes() const {
+        size_t n = 0;
+        for (auto& s : shards_) n += s->bytes();
+        return n;
+    }
+
+    json stats() const {
+        uint64_t hits = 0, misses = 0;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            hits += counters_[i].hits.load(std::memory_order_relaxed);
+            misses += counters_[i].misses.load(std::memory_order_relaxed);
+        }
+        return json{{"policy", config_.policy},
+                    {"hits", hits},
+                    {"misses", misses},
+                    {"hit_ratio", hits + misses ? (double)hits / (hits + misses) : 0.0},
+                    {"shards", shards_.size()},
+                    {"items", items()},
+                    {"max_items", config_.max_items},
+                    {"bytes", bytes()},
+                    {"max_bytes", config_.max_bytes}};
+    }
+};
+
+
+// ---------- NegativeCache ----------
+/**
+ *  Remembers keys the database reported absent, for a bounded time and
+ *  with its own item limit (oldest first out), so repeated 404s are
+ *  answered from memory. Writes must erase() the key once committed.
+ *
+ *  A lookup that found nothing may finish after a concurrent write
+ *  already erased the key; to keep it from caching a stale absence, the
+ *  caller takes generation() before querying and put() is ignored if
+ *  the key's shard saw an erase since.
+ */
+class NegativeCache
+{
+private:
+    static constexpr size_t SHARDS = 16;
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        Clock::time_point expires;
+        std::list<std::string>::iterator order;
+    };
+    struct alignas(64) Shard
+    {
+        std::mutex mu;
+        std::unordered_map<std::string, Entry> entries;
+        // Insertion order, oldest first, for the item limit
+        std::list<std::string> order;
+        uint64_t generation = 0;
+    };
+
+    Shard shards_[SHARDS];
+    size_t max_per_shard_;
+    Clock::duration ttl_;
+    std::atomic<size_t> items_{0};
+    std::atomic<uint64_t> hits_{0};
+
+    Shard &shard_for(const std::string &key)
+    {
+        return shards_[std::hash<std::string>{}(key) % SHARDS];
+    }
+
+    void remove(Shard &shard, std::unordered_map<std::string, Entry>::iterator it)
+    {
+        shard.order.erase(it->second.order);
+        shard.entries.erase(it);
+        --items_;
+    }
+
+public:
+    NegativeCache(size_t max_items, size_t ttl_ms)
+        : max_per_shard_(ttl_ms ? (max_items + SHARDS - 1) / SHARDS : 0),
+          ttl_(std::chrono::milliseconds(ttl_ms)) {}
+
+    bool enabled() const { return max_per_shard_ > 0; }
+
+    // True if `key` is known to be absent.
+    bool contains(const std::string &key)
+    {
+        if (!enabled())
+            return false;
+        Shard &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end())
+            return false;
+        if (Clock::now() >= it->second.expires)
+        {
+            remove(shard, it);
+            return false;
+        }
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t generation(const std::string &key)
+    {
+        Shard &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        return shard.generation;
+    }
+
+    void put(const std::string &key, uint64_t generation)
+    {
+        if (!enabled())
+            return;
+        Shard &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        if (shard.generation != generation)
+            return;
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+            remove(shard, it);
+        while (shard.entries.size() >= max_per_shard_)
+            remove(shard, shard.entries.find(shard.order.front()));
+        shard.order.push_back(key);
+        shard.entries.emplace(key, Entry{Clock::now() + ttl_, std::prev(shard.order.end())});
+        ++items_;
+    }
+
+    void erase(const std::string &key)
+    {
+        if (!enabled())
+            return;
+        Shard &shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        shard.generation++;
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+            remove(shard, it);
+    }
+
+    void clear()
+    {
+        for (Shard &shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.mu);
+            shard.generation++;
+            items_ -= shard.entries.size();
+            shard.entries.clear();
+            shard.order.clear();
+        }
+    }
+
+    json stats() const
+    {
+        return json{{"items", items_.load()},
+                    {"hits", hits_.load(std::memory_order_relaxed)},
+                    {"max_items", max_per_shard_ * SHARDS},
+                    {"ttl_ms", std::chrono::duration_cast<std::chrono::milliseconds>(ttl_).count()}};
+    }
+};
+
+// ---------- SingleFlight ----------
+/**
+ *  Collapses concurrent calls for the same key into one: the first caller
+ *  (the leader) runs the function, later callers for that key wait for
+ *  and share its result. A key is only in flight while its leader runs,
+ *  so nothing is cached here. The key table is sharded like the cache.
+ */
+template <typename V>
+class SingleFlight
+{
+private:
+    static constexpr size_t SHARDS = 64;
+
+    struct Call
+    {
+        std::promise<V> promise;
+        std::shared_future<V> result;
+    };
+    struct alignas(64) Shard
+    {
+        std::mutex mu;
+        std::unordered_map<std::string, std::shared_ptr<Call>> calls;
+    };
+
+    Shard shards_[SHARDS];
+    std::atomic<uint64_t> leaders_{0};
+    std::atomic<uint64_t> collapsed_{0};
+
+public:
+    V run(const std::string &key, const std::function<V()> &fn)
+    {
+        Shard &shard = shards_[std::hash<std::string>{}(key) % SHARDS];
+        std::shared_ptr<Call> call;
+        bool leader = false;
+        {
+            std::lock_guard<std::mutex> lock(shard.mu);
+            auto it = shard.calls.find(key);
+            if (it != shard.calls.end())
+                call = it->second;
+            else
+            {
+                call = std::make_shared<Call>();
+                call->result = call->promise.get_future().share();
+                shard.calls.emplace(key, call);
+                leader = true;
+            }
+        }
+
+        if (!leader)
+        {
+            collapsed_.fetch_add(1, std::memory_order_relaxed);
+            return call->result.get();
+        }
+
+        leaders_.fetch_add(1, std::memory_order_relaxed);
+        V value;
+        try
+        {
+            value = fn();
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> lock(shard.mu);
+                shard.calls.erase(key);
+            }
+            call->promise.set_exception(std::current_exception());
+            throw;
+        }
+        // Unregister before publishing: callers arriving from here on
+        // start a fresh fetch instead of reusing this result
+        {
+            std::lock_guard<std::mutex> lock(shard.mu);
+            shard.calls.erase(key);
+        }
+        call->promise.set_value(value);
+        return value;
+    }
+
+    json stats() const
+    {
+        return json{{"fetches", leaders_.load(std::memory_order_relaxed)},
+                    {"collapsed", collapsed_.load(std::memory_order_relaxed)}};
+    }
+};
+
+// ---------- GroupCommit ----------
+/**
+ *  Synchronous group commit for PUT/DELETE. Writers queue up; the one at
+ *  the head becomes leader, commits every queued write (up to `max`) as
+ *  one transaction (a kv_mput multi-row upsert plus a kv_mdel), and then
+ *  releases the followers, handing leadership to the next writer in
+ *  line. Writes that arrive while a commit is in progress form the next
+ *  group, so the number of commits per second adapts to load with no
+ *  timer. Each writer returns only after its write is committed, so
+ *  durability is that of a plain single-row commit.
+ *
+ *  Within a group the last write per key wins, and every writer's
+ *  `apply` callback runs in queue order right after the commit, so the
+ *  cache follows the same order as the database. If a group's
+ *  transaction fails, its writes are retried one statement each so one
+ *  bad row only fails its own writer.
+ */
+class GroupCommit
+{
+private:
+    struct Writer
+    {
+        bool del;
+        const std::string *key;
+        const std::string *value;
+        const std::function<void()> *apply;
+        bool done = false;
+        std::string error;
+        std::condition_variable cv;
+
+        Writer(bool d, const std::string *k, const std::string *v, const std::function<void()> *a)
+            : del(d), key(k), value(v), apply(a) {}
+    };
+
+    PGPool &pool_;
+    size_t max_;
+    std::mutex m_;
+    std::deque<Writer *> writers_;
+    std::atomic<uint64_t> commits_{0};
+    std::atomic<uint64_t> writes_{0};
+    std::atomic<uint64_t> fallbacks_{0};
+
+    // Commits `group` as one transaction; returns false with `err` set.
+    static bool commit(PGconn *c, const std::vector<Writer *> &group, std::string &err)
+    {
+        std::vector<BatchWrite> writes;
+        writes.reserve(group.size());
+        for (Writer *w : group)
+            writes.push_back(BatchWrite{w->del, w->key, w->value});
+
+        return run_in_transaction(c, [&](std::string &e)
+                                  { return apply_writes(c, writes, e); }, err);
+    }
+
+    // Runs `group` on one pooled connection, setting each writer's error.
+    void execute(const std::vector<Writer *> &group)
+    {
+        PGconn *c = pool_.acquire();
+        if (!c)
+        {
+            for (Writer *w : group)
+                w->error = "timed out waiting for a database connection";
+            return;
+        }
+        std::string err;
+        if (!commit(c, group, err))
+        {
+            if (group.size() == 1)
+                group[0]->error = err;
+            else
+            {
+                fallbacks_.fetch_add(1, std::memory_order_relaxed);
+                for (Writer *w : group)
+                {
+                    if (w->del)
+                        run_prepared(c, "kv_del", {*w->key}, w->error);
+                    else
+                        run_prepared(c, "kv_put", {*w->key, *w->value}, w->error);
+                }
+            }
+        }
+        pool_.release(c);
+        commits_.fetch_add(1, std::memory_order_relaxed);
+        writes_.fetch_add(group.size(), std::memory_order_relaxed);
+    }
+
+public:
+    GroupCommit(PGPool &pool, size_t max) : pool_(pool), max_(std::max<size_t>(1, max)) {}
+
+    /**
+     *  Commits one write and returns "" once it is durable, or the error.
+     *  `key` must be an integer (see is_int_key); `apply` runs after the
+     *  commit succeeds, in the same order as the writes were queued.
+     */
+    std::string write(bool del, const std::string &key, const std::string &value,
+                      const std::function<void()> &apply)
+    {
+        Writer w(del, &key, &value, &apply);
+        std::unique_lock<std::mutex> lk(m_);
+        writers_.push_back(&w);
+        while (!w.done && writers_.front() != &w)
+            w.cv.wait(lk);
+        if (w.done)
+            return w.error;
+
+        // Leader: take the group, commit it without the lock held
+        std::vector<Writer *> group(writers_.begin(),
+                                    writers_.begin() + std::min(max_, writers_.size()));
+        lk.unlock();
+        execute(group);
+        lk.lock();
+
+        for (Writer *g : group)
+        {
+            if (g->error.empty())
+                (*g->apply)();
+            writers_.pop_front();
+            g->done = true;
+            if (g != &w)
+                g->cv.notify_one();
+        }
+        if (!writers_.empty())
+            writers_.front()->cv.notify_one();
+        return w.error;
+    }
+
+    json stats() const
+    {
+        uint64_t commits = commits_.load(std::memory_order_relaxed);
+        uint64_t writes = writes_.load(std::memory_order_relaxed);
+        return json{{"commits", commits},
+                    {"writes", writes},
+                    {"avg_group", commits ? (double)writes / commits : 0.0},
+                    {"fallbacks", fallbacks_.load(std::memory_order_relaxed)}};
+    }
+};
+
+// ---------- MissBatcher ----------
+struct MissBatchConfig
+{
+    size_t window_us = MISS_BATCH_WINDOW_US;
+    size_t max_keys = MISS_BATCH_MAX_KEYS;
+    size_t workers = MISS_BATCH_WORKERS;
+};
+
+/**
+ *  Micro-batches point reads: concurrent callers of get() are queued,
+ *  and a worker runs one query for a batch of them, typically SELECT k,
+ *  v ... WHERE k = ANY($1). Each caller gets the shared reply and the
+ *  index of its row (-1 if absent). Batching is adaptive: with no batch
+ *  out at the database, a worker sends whatever is queued at once, so a
+ *  lone miss never waits. While one is out, misses pile up and the next
+ *  worker waits up to `window_us` after the first of them (or until
+ *  `max_keys` are waiting, or the outstanding batch returns).
+ */
+class MissBatcher
+{
+public:
+    struct Row
+    {
+        std::shared_ptr<DbReply> reply;
+        int row = -1;
+    };
+    // Runs one batch; rows must have the integer key in column 0
+    using Query = std::function<DbReply(const std::vector<std::string> &keys)>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Waiter
+    {
+        const std::string *key;
+        std::promise<Row> done;
+    };
+
+    Query query_;
+    MissBatchConfig config_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<Waiter *> queue_;
+    Clock::time_point first_; // arrival of the oldest queued key
+    size_t inflight_ = 0;     // batches out at the database
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+    std::atomic<uint64_t> batches_{0};
+    std::atomic<uint64_t> keys_{0};
+
+    void worker()
+    {
+        while (true)
+        {
+            std::vector<Waiter *> batch;
+            {
+                std::unique_lock<std::mutex> lk(m_);
+                cv_.wait(lk, [&]
+                         { return stopping_ || !queue_.empty(); });
+                if (queue_.empty())
+                    return; // stopping
+                if (inflight_ > 0)
+                    cv_.wait_until(lk, first_ + std::chrono::microseconds(config_.window_us), [&]
+                                   { return stopping_ || queue_.size() >= config_.max_keys || queue_.empty() ||
+                                            inflight_ == 0; });
+                if (queue_.empty())
+                    continue; // another worker took them
+                while (!queue_.empty() && batch.size() < config_.max_keys)
+                {
+                    batch.push_back(queue_.front());
+                    queue_.pop_front();
+                }
+                ++inflight_;
+                if (!queue_.empty())
+                {
+                    first_ = Clock::now();
+                    cv_.notify_one();
+                }
+            }
+            run(batch);
+            {
+                std::lock_guard<std::mutex> lk(m_);
+                --inflight_;
+            }
+            // A worker holding a partial batch may now send it
+            cv_.notify_all();
+        }
+    }
+
+    void run(const std::vector<Waiter *> &batch)
+    {
+        std::vector<std::string> keys;
+        keys.reserve(batch.size());
+        for (Waiter *w : batch)
+            keys.push_back(*w->key);
+        auto reply = std::make_shared<DbReply>(query_(keys));
+        batches_.fetch_add(1, std::memory_order_relaxed);
+        keys_.fetch_add(batch.size(), std::memory_order_relaxed);
+
+        // Match by integer value: "007" and "7" are the same row
+        std::unordered_map<long long, int> rows;
+        if (reply->ok())
+        {
+            PGresult *res = reply->res.get();
+            for (int row = 0; row < PQntuples(res); ++row)
+                rows.emplace(std::stoll(PQgetvalue(res, row, 0)), row);
+        }
+        for (Waiter *w : batch)
+        {
+            auto it = rows.find(std::stoll(*w->key));
+            w->done.set_value(Row{reply, it == rows.end() ? -1 : it->second});
+        }
+    }
+
+public:
+    MissBatcher(Query query, const MissBatchConfig &config) : query_(std::move(query)), config_(config)
+    {
+        config_.max_keys = std::max<size_t>(1, config_.max_keys);
+        for (size_t i = 0; i < std::max<size_t>(1, config_.workers); ++i)
+            workers_.emplace_back(&MissBatcher::worker, this);
+    }
+
+    ~MissBatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : workers_)
+            t.join();
+    }
+
+    // Blocks until the batch holding `key` has run. `key` must be an
+    // integer (see is_int_key).
+    Row get(const std::string &key)
+    {
+        Waiter w{&key, {}};
+        std::future<Row> f = w.done.get_future();
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            if (queue_.empty())
+                first_ = Clock::now();
+            queue_.push_back(&w);
+        }
+        cv_.notify_one();
+        return f.get();
+    }
+
+    json stats() const
+    {
+        uint64_t batches = batches_.load(std::memory_order_relaxed);
+        uint64_t keys = keys_.load(std::memory_order_relaxed);
+        return json{{"batches", batches},
+                    {"keys", keys},
+                    {"avg_batch", batches ? (double)keys / batches : 0.0},
+                    {"window_us", config_.window_us},
+                    {"max_keys", config_.max_keys}};
+    }
+};
+
+// ---------- KVHandler ----------
+class KVHandler : public CivetHandler
+{
+public:
+    // Outcome of a core operation, independent of the wire protocol
+    enum class Status
+    {
+        Ok,
+        NotFound,
+        BadKey,
+        DbError,
+        Busy // write-behind queue full; retry later
+    };
+    struct Result
+    {
+        Status status = Status::Ok;
+        // GET: whether the value came from the cache
+        bool hit = false;
+        // GET: the value; DbError: the error message
+        std::string value;
+    };
+
+private:
+    PGPool &pool_;
+    // Optional async executor; when null, statements run on pool_.
+    PGPipeline *pipeline_;
+    // Optional write-behind queue; when null, writes commit synchronously.
+    WriteBehindQueue *write_behind_;
+    // Optional miss batcher; when null, each miss runs its own kv_get.
+    MissBatcher *miss_batcher_;
+    // Optional group commit; when null, each synchronous write commits alone.
+    GroupCommit *group_commit_;
+    // --- CACHE ---
+    // Our in-memory cache; locking is done per shard inside it.
+    ShardedCache cache_;
+    // --- END CACHE ---
+    // Keys recently found absent; see NegativeCache
+    NegativeCache negative_;
+    // In-flight database reads, so a herd on one missing key costs one query
+    SingleFlight<Result> flights_;
+
+    // Startup warm-up progress, reported on /stats
+    std::thread warmup_thread_;
+    std::atomic<bool> warmup_running_{false};
+    std::atomic<uint64_t> warmup_rows_{0};
+    std::atomic<uint64_t> warmup_ms_{0};
+
+    /**
+     *  Loads up to `limit` recently written rows into the cache in the
+     *  background while the server already takes traffic. The key range
+     *  is split into `slices` slices read in parallel, each on its own
+     *  pooled connection in single-row mode, so no result set is held in
+     *  memory. Rows go in through ShardedCache::fill, which never replaces
+     *  a value that live traffic wrote or erased meanwhile.
+     */
+    void warmUpCache(size_t limit, size_t slices)
+    {
+        auto start = std::chrono::steady_clock::now();
+        DbReply bounds = exec_sql("SELECT min(k), max(k) FROM kv_store");
+        if (!bounds.ok() || PQgetisnull(bounds.res.get(), 0, 0))
+        {
+            if (!bounds.ok())
+                std::cerr << "Cache warm-up skipped: " << bounds.error << std::endl;
+            warmup_running_ = false;
+            return;
+        }
+        long long lo = std::stoll(PQgetvalue(bounds.res.get(), 0, 0));
+        long long hi = std::stoll(PQgetvalue(bounds.res.get(), 0, 1));
+        long long width = (hi - lo) / (long long)slices + 1;
+        size_t per_slice = (limit + slices - 1) / slices;
+
+        cache_.begin_fill();
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < slices; ++i)
+        {
+            long long from = lo + (long long)i * width;
+            long long to = std::min(hi, from + width - 1);
+            if (from > hi)
+                break;
+            workers.emplace_back([this, from, to, per_slice]
+                                 { warmUpSlice(from, to, per_slice); });
+        }
+        for (auto &t : workers)
+            t.join();
+        cache_.end_fill();
+
+        warmup_ms_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+        warmup_running_ = false;
+        std::cout << "Cache warm-up complete: " << warmup_rows_ << " rows in " << warmup_ms_ << " ms" << std::endl;
+    }
+
+    void warmUpSlice(long long from, long long to, size_t limit)
+    {
+        PGconn *pg = pool_.acquire();
+        if (!pg)
+        {
+            std::cerr << "Cache warm-up slice skipped: no database connection" << std::endl;
+            return;
+        }
+        std::string p_from = std::to_string(from), p_to = std::to_string(to), p_limit = std::to_string(limit);
+        const char *params[] = {p_from.c_str(), p_to.c_str(), p_limit.c_str()};
+        if (!PQsendQueryParams(pg,
+                               "SELECT k, v FROM kv_store WHERE k BETWEEN $1 AND $2 "
+                               "ORDER BY updated_at DESC LIMIT $3",
+                               3, nullptr, params, nullptr, nullptr, 0) ||
+            !PQsetSingleRowMode(pg))
+        {
+            std::cerr << "Cache warm-up slice failed: " << PQerrorMessage(pg) << std::endl;
+            while (PGresult *r = PQgetResult(pg))
+                PQclear(r);
+            pool_.release(pg);
+            return;
+        }
+
+        while (PGresult *r = PQgetResult(pg))
+        {
+            ExecStatusType st = PQresultStatus(r);
+            if (st == PGRES_SINGLE_TUPLE)
+            {
+                std::string key(PQgetvalue(r, 0, 0), PQgetlength(r, 0, 0));
+                std::string val(PQgetvalue(r, 0, 1), PQgetlength(r, 0, 1));
+                if (cache_.fill(key, val))
+                    warmup_rows_.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (st != PGRES_TUPLES_OK)
+                std::cerr << "Cache warm-up slice failed: " << PQresultErrorMessage(r) << std::endl;
+            PQclear(r);
+        }
+        pool_.release(pg);
+    }
+
+    // Runs a plain query on a pooled connection.
+    DbReply exec_sql(const char *sql)
+    {
+        PGconn *pg = pool_.acquire();
+        if (!pg)
+        {
+            DbReply reply;
+            reply.error = "timed out waiting for a database connection";
+            return reply;
+        }
+        DbReply reply = make_reply(pg, PQexec(pg, sql));
+        pool_.release(pg);
+        return reply;
+    }
+
+    DbReply exec(const char *stmt, std::vector<std::string> params)
+    {
+        return run_statement(pool_, pipeline_, stmt, std::move(params));
+    }
+
+    // Sends a found value, either as the bare bytes (raw mode) or wrapped
+    // in the usual JSON object.
+    static void sendValue(struct mg_connection *conn, bool raw, const std::string &key,
+                          const std::string &value, const char *cache)
+    {
+        if (raw)
+            send_octets(conn, 200, value.data(), value.size());
+        else
+            JsonResponse(200).field("key", key).field("value", value).field("cache", cache).send(conn);
+    }
+
+    // Reads one key from Postgres and caches what it finds.
+    Result fetch(const std::string &key)
+    {
+        Result out;
+        uint64_t generation = negative_.generation(key);
+
+        // Batched reads share one kv_mget (k, v columns) with other misses
+        std::shared_ptr<DbReply> reply;
+        int row = 0, column = 0;
+        if (miss_batcher_)
+        {
+            // kv_store.k is INTEGER, so anything else cannot be stored
+            if (!is_int_key(key))
+            {
+                out.status = Status::NotFound;
+                return out;
+            }
+            MissBatcher::Row r = miss_batcher_->get(key);
+            reply = std::move(r.reply);
+            row = r.row;
+            column = 1;
+        }
+        else
+            reply = std::make_shared<DbReply>(exec("kv_get", {key}));
+
+        if (!reply->ok())
+        {
+            out.status = Status::DbError;
+            out.value = reply->error;
+            return out;
+        }
+
+        PGresult *res = reply->res.get();
+        if (row < 0 || PQntuples(res) == 0)
+        {
+            negative_.put(key, generation);
+            out.status = Status::NotFound;
+            return out;
+        }
+
+        out.value.assign(PQgetvalue(res, row, column), PQgetlength(res, row, column));
+
+        // --- CACHE ---
+        // 3. Store the retrieved value in the cache
+        cache_.put(key, out.value);
+        // --- END CACHE ---
+        return out;
+    }
+
+    bool doGet(struct mg_connection *conn, const std::string &key, bool raw)
+    {
+        Result r = get(key);
+        switch (r.status)
+        {
+        case Status::Ok:
+            sendValue(conn, raw, key, r.value, r.hit ? "HIT" : "MISS");
+            break;
+        case Status::NotFound:
+            JsonResponse(404).field("error", "not_found").field("cache", "MISS").send(conn);
+            break;
+        default:
+            sendError(conn, r);
+        }
+        return true;
+    }
+
+    static void sendError(struct mg_connection *conn, const Result &r)
+    {
+        if (r.status == Status::BadKey)
+            JsonResponse(400).field("error", "invalid_key").send(conn);
+        else if (r.status == Status::Busy)
+            JsonResponse(503).field("error", "write_backlog_full").send(conn);
+        else
+            JsonResponse(500).field("error", "db_error").field("message", r.value).send(conn);
+    }
+
+    // Raw-mode PUTs store the body verbatim and answer with an empty body
+    // instead of echoing the value back.
+    bool doPut(struct mg_connection *conn, const std::string &key, bool raw)
+    {
+        // Large non-JSON values skip the cache and go to Postgres via COPY,
+        // so only the first `put_stream_threshold` bytes are ever held.
+        // Write-behind has to journal the value anyway, so it keeps the
+        // in-memory path.
+        bool may_stream = !write_behind_ && put_stream_threshold;
+        BodyChain body;
+        if (!body.read(conn, may_stream ? put_stream_threshold : 0))
+        {
+            JsonResponse(400).field("error", "body_read_failed").send(conn);
+            return true;
+        }
+        if (!body.done())
+        {
+            if (raw || body.front() != '{')
+                return doStreamPut(conn, key, body, raw);
+            // A large JSON body has to be parsed whole
+            if (!body.read(conn))
+            {
+                JsonResponse(400).field("error", "body_read_failed").send(conn);
+                return true;
+            }
+        }
+
+        // If client sends JSON { "value": "..." }
+        std::string value = body.str();
+        if (!raw)
+        {
+            try
+            {
+                json j = json::parse(value);
+                if (j.contains("value"))
+                    value = j["value"].get<std::string>();
+            }
+            catch (...)
+            {
+                //  treat as raw string
+            }
+        }
+
+        Result r = put(key, value);
+        if (r.status == Status::Ok)
+            sendStored(conn, raw, key, value);
+        else
+            sendError(conn, r);
+        return true;
+    }
+
+    // Sends the bytes already read, then copies the rest of the body to
+    // Postgres block by block as it arrives.
+    bool doStreamPut(struct mg_connection *conn, const std::string &key, const BodyChain &head, bool raw)
+    {
+        // The key goes into the COPY text stream as is, so it must be a
+        // plain integer (no tabs or newlines to smuggle in extra rows)
+        if (!is_int_key(key))
+        {
+            JsonResponse(400).field("error", "invalid_key").send(conn);
+            return true;
+        }
+        PGconn *pg = pool_.acquire();
+        if (!pg)
+        {
+            JsonResponse(500).field("error", "db_error").field("message", "timed out waiting for a database connection").send(conn);
+            return true;
+        }
+        bool ok, read_ok = true;
+        std::string err;
+        size_t bytes = head.size();
+        {
+            CopyPut copy(pg, canonical_key(key));
+            head.for_each([&](const char *p, size_t n)
+                          { copy.write(p, n); });
+            std::unique_ptr<char[]> block = BlockPool::instance().get();
+            int n;
+            while ((n = mg_read(conn, block.get(), BODY_BLOCK_SIZE)) > 0)
+            {
+                bytes += n;
+                if (!copy.write(block.get(), n))
+                    break;
+            }
+            BlockPool::instance().put(std::move(block));
+            if (n < 0)
+            {
+                read_ok = false;
+                copy.abort("request body read failed");
+            }
+            ok = copy.finish();
+            if (!ok)
+                err = copy.error();
+        }
+        pool_.release(pg);
+        if (!read_ok)
+        {
+            JsonResponse(400).field("error", "body_read_failed").send(conn);
+            return true;
+        }
+        if (!ok)
+        {
+            JsonResponse(500).field("error", "db_error").field("message", err).send(conn);
+            return true;
+        }
+
+        // Too big to be worth caching; drop any stale copy instead
+        cache_.erase(key);
+        negative_.erase(key);
+        if (raw)
+            send_octets(conn, 200, "", 0);
+        else
+            JsonResponse(200).field("status", "ok").field("key", key)
+                .field("bytes", std::to_string(bytes)).send(conn);
+        return true;
+    }
+
+    static void sendStored(struct mg_connection *conn, bool raw, const std::string &key,
+                           const std::string &value)
+    {
+        if (raw)
+            send_octets(conn, 200, "", 0);
+        else
+            JsonResponse(200).field("status", "ok").field("key", key).field("value", value).send(conn);
+    }
+
+    // Splits "/kv/<key>" or "/raw/<key>" into the decoded key; the /raw/
+    // route, or an octet-stream Accept header, selects raw mode.
+    static bool parseKeyUri(struct mg_connection *conn, const struct mg_request_info *ri,
+                            std::string &key, bool &raw)
+    {
+        std::string uri = ri->local_uri ? ri->local_uri : "";
+        if (uri.rfind("/kv/", 0) == 0)
+        {
+            key = url_decode(uri.substr(4));
+            raw = header_has(conn, "Accept", "application/octet-stream");
+            return true;
+        }
+        if (uri.rfind("/raw/", 0) == 0)
+        {
+            key = url_decode(uri.substr(5));
+            raw = true;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     *  Reads the key list of a batch request: "?keys=1,2,3" on GET, or a
+     *  JSON body on POST, either ["1","2"] or {"keys":["1","2"]}.
+     *  Returns false (after answering 400) if it is unusable.
+     */
+    static bool readKeys(struct mg_connection *conn, const struct mg_request_info *ri,
+                         std::vector<std::string> &keys)
+    {
+        if (strcmp(ri->request_method, "GET") == 0)
+        {
+            std::string query = ri->query_string ? ri->query_string : "";
+            size_t at = query.rfind("keys=", 0) == 0 ? 0 : query.find("&keys=");
+            if (at != std::string::npos)
+            {
+                size_t from = query.find('=', at) + 1;
+                std::string list = url_decode(query.substr(from, query.find('&', from) - from));
+                std::stringstream ss(list);
+                std::string key;
+                while (std::getline(ss, key, ','))
+                    if (!key.empty())
+                        keys.push_back(key);
+            }
+        }
+        else
+        {
+            BodyChain body;
+            try
+            {
+                if (!body.read(conn))
+                    throw std::runtime_error("read");
+                json j = json::parse(body.str());
+                const json &list = j.is_object() ? j.at("keys") : j;
+                for (const auto &k : list)
+                    keys.push_back(k.is_string() ? k.get<std::string>() : k.dump());
+            }
+            catch (...)
+            {
+                JsonResponse(400).field("error", "invalid_body").send(conn);
+                return false;
+            }
+        }
+
+        if (keys.empty() || keys.size() > BATCH_MAX_KEYS)
+        {
+            JsonResponse(400).field("error", "invalid_key_count")
+                .field("max", std::to_string(BATCH_MAX_KEYS)).send(conn);
+            return false;
+        }
+        return true;
+    }
+
+    // Answers {"values":{...},"missing":[...]} for the found and absent
+    // keys, or 500 if the database failed for any of them.
+    bool doMget(struct mg_connection *conn, const struct mg_request_info *ri)
+    {
+        std::vector<std::string> keys;
+        if (!readKeys(conn, ri, keys))
+            return true;
+
+        std::vector<Result> results = mget(keys);
+        for (const Result &r : results)
+        {
+            if (r.status == Status::DbError)
+            {
+                sendError(conn, r);
+                return true;
+            }
+        }
+
+        JsonResponse resp(200);
+        resp.begin("values", '{');
+        for (size_t i = 0; i < keys.size(); ++i)
+            if (results[i].status == Status::Ok)
+                resp.field(keys[i].c_str(), results[i].value);
+        resp.end('}').begin("missing", '[');
+        for (size_t i = 0; i < keys.size(); ++i)
+            if (results[i].status == Status::NotFound)
+                resp.element(keys[i]);
+        resp.end(']').send(conn);
+        return true;
+    }
+
+    // POST /mset with {"1":"a","2":"b"} (non-string values are stored
+    // as their JSON text).
+    bool doMset(struct mg_connection *conn)
+    {
+        std::vector<std::pair<std::string, std::string>> items;
+        BodyChain body;
+        try
+        {
+            if (!body.read(conn))
+                throw std::runtime_error("read");
+            json j = json::parse(body.str());
+            if (!j.is_object())
+                throw std::runtime_error("not an object");
+            for (auto it = j.begin(); it != j.end(); ++it)
+                items.emplace_back(it.key(), it->is_string() ? it->get<std::string>() : it->dump());
+        }
+        catch (...)
+        {
+            JsonResponse(400).field("error", "invalid_body").send(conn);
+            return true;
+        }
+        if (items.empty() || items.size() > BATCH_MAX_KEYS)
+        {
+            JsonResponse(400).field("error", "invalid_key_count")
+                .field("max", std::to_string(BATCH_MAX_KEYS)).send(conn);
+            return true;
+        }
+
+        Result r = mset(items);
+        if (r.status == Status::Ok)
+            JsonResponse(200).field("status", "ok").field("count", std::to_string(items.size())).send(conn);
+        else
+            sendError(conn, r);
+        return true;
+    }
+
+    // POST /mdel with the same key list formats as /mget.
+    bool doMdel(struct mg_connection *conn, const struct mg_request_info *ri)
+    {
+        std::vector<std::string> keys;
+        if (!readKeys(conn, ri, keys))
+            return true;
+
+        Result r = mdel(keys);
+        if (r.status == Status::Ok)
+            JsonResponse(200).field("status", "deleted").field("count", std::to_string(keys.size())).send(conn);
+        else
+            sendError(conn, r);
+        return true;
+    }
+
+    /**
+     *  POST /import streams the request body (see BulkImport) into
+     *  kv_store without buffering it. The whole cache is dropped once the
+     *  load commits, since any cached key may have been overwritten;
+     *  with ?cache=1 it is then refilled with the last rows loaded. Not
+     *  available in write-behind mode.
+     */
+    bool doImport(struct mg_connection *conn, const struct mg_request_info *ri)
+    {
+        // Writes acknowledged but not yet flushed would land after the
+        // load commits and silently overwrite imported rows
+        if (write_behind_)
+        {
+            JsonResponse(409).field("error", "import_unavailable")
+                .field("message", "not supported with WRITE_MODE=writebehind").send(conn);
+            return true;
+        }
+
+        bool fill = queryParam(ri, "cache", "0") == "1";
+        size_t cache_rows = 0;
+        if (fill)
+            cache_rows = cache_.config().max_items ? cache_.config().max_items : CACHE_MAX_ITEMS;
+
+        PGconn *pg = pool_.acquire();
+        if (!pg)
+        {
+            JsonResponse(500).field("error", "db_error").field("message", "timed out waiting for a database connection").send(conn);
+            return true;
+        }
+
+        bool ok;
+        std::string err;
+        size_t rows, bytes;
+        double seconds, rate;
+        std::deque<std::pair<std::string, std::string>> recent;
+        {
+            BulkImport import(pg, cache_rows);
+            std::unique_ptr<char[]> block = BlockPool::instance().get();
+            bool read_ok = true;
+            int n;
+            while ((n = mg_read(conn, block.get(), BODY_BLOCK_SIZE)) > 0)
+                if (!import.write(block.get(), n))
+                    break;
+            if (n < 0)
+                read_ok = false;
+            BlockPool::instance().put(std::move(block));
+
+            ok = read_ok && import.finish();
+            if (!read_ok)
+                err = "request body read failed";
+            else if (!ok)
+                err = import.error();
+            rows = import.rows();
+            bytes = import.bytes();
+            seconds = import.seconds();
+            rate = import.rows_per_sec();
+            recent = import.take_recent();
+        }
+        pool_.release(pg);
+
+        if (!ok)
+        {
+            JsonResponse(500).field("error", "import_failed").field("message", err).send(conn);
+            return true;
+        }
+
+        cache_.clear();
+        negative_.clear();
+        for (auto &kv : recent)
+            cache_.put(kv.first, kv.second);
+        std::cout << "Import done: " << rows << " rows in " << seconds << " s (" << (size_t)rate << " rows/s)" << std::endl;
+        JsonResponse(200).field("status", "ok").field("rows", std::to_string(rows))
+            .field("bytes", std::to_string(bytes)).field("seconds", std::to_string(seconds))
+            .field("rows_per_sec", std::to_string((size_t)rate)).field("cached", std::to_string(recent.size()))
+            .send(conn);
+        return true;
+    }
+
+    // Value of query parameter `name`, or `fallback` if absent.
+    static std::string queryParam(const struct mg_request_info *ri, const char *name, const std::string &fallback)
+    {
+        std::string query = ri->query_string ? ri->query_string : "";
+        std::string prefix = std::string(name) + "=";
+        size_t at = 0;
+        while (at < query.size())
+        {
+            size_t end = query.find('&', at);
+            if (end == std::string::npos)
+                end = query.size();
+            if (query.compare(at, prefix.size(), prefix) == 0)
+                return url_decode(query.substr(at + prefix.size(), end - at - prefix.size()));
+            at = end + 1;
+        }
+        return fallback;
+    }
+
+    /**
+     *  GET /kv?from=&to=&limit= returns the rows with from <= k <= to in
+     *  key order as {"items":[{"key":..,"value":..},...],"count":N,
+     *  "next":K}. "next" is present when the limit was reached before the
+     *  end of the range and is the `from` of the following page. Rows are fetched in keyset
+     *  pages (k > last key seen, so no server-side cursor stays open) and
+     *  each page is streamed as its own chunk, so memory use does not grow
+     *  with the range. The scan reads committed rows only; pages are
+     *  separate statements, not one snapshot.
+     */
+    bool doScan(struct mg_connection *conn, const struct mg_request_info *ri)
+    {
+        std::string from = queryParam(ri, "from", std::to_string(INT32_MIN));
+        std::string to = queryParam(ri, "to", std::to_string(INT32_MAX));
+        std::string limit_text = queryParam(ri, "limit", std::to_string(SCAN_DEFAULT_LIMIT));
+        if (!is_int_key(from) || !is_int_key(to) || limit_text.empty() ||
+            limit_text.find_first_not_of("0123456789") != std::string::npos || limit_text.size() > 18)
+        {
+            JsonResponse(400).field("error", "invalid_range").send(conn);
+            return true;
+        }
+        long long next = std::stoll(from);
+        const long long last = std::stoll(to);
+        size_t limit = std::stoull(limit_text);
+        if (limit == 0)
+            limit = SIZE_MAX;
+
+        std::unique_ptr<ChunkedResponse> out;
+        std::string page = "{\"items\":[";
+        size_t count = 0;
+        bool more = false;
+        std::string error;
+        while (next <= last)
+        {
+            size_t want = std::min(SCAN_PAGE_SIZE, limit - count);
+            if (want == 0)
+            {
+                more = true;
+                break;
+            }
+            DbReply r = exec("kv_scan", {std::to_string(next), std::to_string(last), std::to_string(want)});
+            if (!r.ok())
+            {
+                if (!out)
+                {
+                    JsonResponse(500).field("error", "db_error").field("message", r.error).send(conn);
+                    return true;
+                }
+                error = r.error;
+                break;
+            }
+
+            PGresult *res = r.res.get();
+            int rows = PQntuples(res);
+            for (int row = 0; row < rows; ++row)
+            {
+                if (count++)
+                    page += ',';
+                page += "{\"key\":";
+                append_json_string(page, PQgetvalue(res, row, 0), PQgetlength(res, row, 0));
+                page += ",\"value\":";
+                append_json_string(page, PQgetvalue(res, row, 1), PQgetlength(res, row, 1));
+                page += '}';
+            }
+            if (rows > 0)
+                next = std::stoll(PQgetvalue(res, rows - 1, 0)) + 1;
+            if (!out)
+                out = std::make_unique<ChunkedResponse>(conn, 200, "application/json");
+            if (!out->chunk(page))
+                return true; // client went away
+            page.clear();
+            if ((size_t)rows < want)
+                break; // range exhausted
+        }
+
+        if (!out)
+            out = std::make_unique<ChunkedResponse>(conn, 200, "application/json");
+        page += "],\"count\":" + std::to_string(count);
+        if (more && next <= last)
+            page += ",\"next\":" + std::to_string(next);
+        if (!error.empty())
+        {
+            // Too late for a status code; report it in the document
+            page += ",\"error\":";
+            append_json_string(page, error.data(), error.size());
+        }
+        page += '}';
+        out->chunk(page);
+        out->finish();
+        return true;
+    }
+
+    bool doDelete(struct mg_connection *conn, const std::string &key)
+    {
+        Result r = del(key);
+        if (r.status == Status::Ok)
+            JsonResponse(200).field("status", "deleted").field("key", key).send(conn);
+        else
+            sendError(conn, r);
+        return true;
+    }
+
+public:
+    KVHandler(PGPool &pool, const CacheConfig &cache_config, PGPipeline *pipeline = nullptr,
+              WriteBehindQueue *write_behind = nullptr, MissBatcher *miss_batcher = nullptr,
+              GroupCommit *group_commit = nullptr)
+        : pool_(pool), pipeline_(pipeline), write_behind_(write_behind), miss_batcher_(miss_batcher),
+          group_commit_(group_commit), cache_(cache_config),
+          negative_(cache_config.negative_max_items, cache_config.negative_ttl_ms)
+    {
+        std::cout << "Cache: " << cache_.shard_count() << " " << cache_config.policy << " shards, max "
+                  << cache_config.max_items << " items / " << cache_config.max_bytes
+                  << " bytes (0 = unlimited)\n";
+        // --- CACHE ---
+        // Fill the cache in the background; requests are served meanwhile
+        if (cache_config.warmup_slices > 0)
+        {
+            size_t limit = cache_config.max_items ? cache_config.max_items : CACHE_MAX_ITEMS;
+            warmup_running_ = true;
+            warmup_thread_ = std::thread(&KVHandler::warmUpCache, this, limit, cache_config.warmup_slices);
+        }
+        // --- END CACHE ---
+    }
+
+    ~KVHandler()
+    {
+        if (warmup_thread_.joinable())
+            warmup_thread_.join();
+    }
+
+    // Core operations shared by the HTTP handlers and the binary protocol.
+    Result get(const std::string &key)
+    {
+        Result out;
+        // --- CACHE ---
+        // 1. Check cache first
+        if (cache_.get(key, out.value))
+        {
+            out.hit = true;
+            return out;
+        }
+        // CACHE MISS.
+        // --- END CACHE ---
+
+        // Acknowledged writes that haven't reached Postgres yet win
+        PendingWrite pending;
+        if (write_behind_ && write_behind_->lookup(key, pending))
+        {
+            if (pending.del)
+            {
+                out.status = Status::NotFound;
+                return out;
+            }
+            cache_.put(key, pending.value);
+            out.value = std::move(pending.value);
+            return out;
+        }
+
+        if (negative_.contains(key))
+        {
+            out.status = Status::NotFound;
+            return out;
+        }
+
+        // Concurrent misses on one key share a single database fetch
+        return flights_.run(key, [&]
+                            { return fetch(key); });
+    }
+
+    Result put(const std::string &key, const std::string &value)
+    {
+        Result out;
+        if (write_behind_)
+        {
+            if (!is_int_key(key))
+            {
+                out.status = Status::BadKey;
+                return out;
+            }
+            if (!write_behind_->enqueue(false, key, value, [&]
+                                        {
+                                            cache_.put(key, value);
+                                            negative_.erase(key); }))
+                out.status = Status::Busy;
+            return out;
+        }
+
+        if (group_commit_)
+        {
+            if (!is_int_key(key))
+            {
+                out.status = Status::BadKey;
+                return out;
+            }
+            out.value = group_commit_->write(false, key, value, [&]
+                                             {
+                                                 cache_.put(key, value);
+                                                 negative_.erase(key); });
+            if (!out.value.empty())
+                out.status = Status::DbError;
+            return out;
+        }
+
+        DbReply r = exec("kv_put", {key, value});
+        if (!r.ok())
+        {
+            out.status = Status::DbError;
+            out.value = std::move(r.error);
+            return out;
+        }
+
+        // --- CACHE ---
+        // DB write was successful, now update the cache.
+        cache_.put(key, value);
+        // --- END CACHE ---
+        negative_.erase(key);
+        return out;
+    }
+
+    Result del(const std::string &key)
+    {
+        Result out;
+        if (write_behind_)
+        {
+            if (!is_int_key(key))
+            {
+                out.status = Status::BadKey;
+                return out;
+            }
+            if (!write_behind_->enqueue(true, key, "", [&]
+                                        { cache_.erase(key); }))
+                out.status = Status::Busy;
+            return out;
+        }
+
+        if (group_commit_)
+        {
+            if (!is_int_key(key))
+            {
+                out.status = Status::BadKey;
+                return out;
+            }
+            out.value = group_commit_->write(true, key, "", [&]
+                                             { cache_.erase(key); });
+            if (!out.value.empty())
+                out.status = Status::DbError;
+            return out;
+        }
+
+        DbReply r = exec("kv_del", {key});
+        if (!r.ok())
+        {
+            out.status = Status::DbError;
+            out.value = std::move(r.error);
+            return out;
+        }
+
+        // --- CACHE ---
+        // DB delete was successful, now remove from cache.
+        cache_.erase(key);
+        // --- END CACHE ---
+        return out;
+    }
+
+    /**
+     *  Writes many pairs with one kv_mput statement (an atomic multi-row
+     *  upsert) followed by a bulk cache update; under write-behind each
+     *  pair is simply enqueued. Later pairs for the same key win. Every
+     *  key must be an integer, otherwise nothing is written.
+     */
+    Result mset(const std::vector<std::pair<std::string, std::string>> &items)
+    {
+        Result out;
+        for (const auto &kv : items)
+        {
+            if (!is_int_key(kv.first))
+            {
+                out.status = Status::BadKey;
+                return out;
+            }
+        }
+
+        if (write_behind_)
+        {
+            std::vector<PendingWrite> writes;
+            writes.reserve(items.size());
+            for (const auto &kv : items)
+                writes.push_back(PendingWrite{false, kv.first, kv.second});
+            if (!write_behind_->enqueue_batch(std::move(writes), [&](const PendingWrite &w)
+                                              {
+                                                  cache_.put(w.key, w.value);
+                                                  negative_.erase(w.key); }))
+                out.status = Status::Busy;
+            return out;
+        }
+
+        // One statement may not upsert the same row twice, so keep only
+        // the last pair per integer key
+        std::unordered_map<long long, size_t> last;
+        for (size_t i = 0; i < items.size(); ++i)
+            last[std::stoll(items[i].first)] = i;
+        std::vector<std::string> keys, values;
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            if (last[std::stoll(items[i].first)] != i)
+                continue;
+            keys.push_back(items[i].first);
+            values.push_back(items[i].second);
+        }
+
+        DbReply r = exec("kv_mput", {pg_array_literal(keys), pg_array_literal(values)});
+        if (!r.ok())
+        {
+            out.status = Status::DbError;
+            out.value = std::move(r.error);
+            return out;
+        }
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            cache_.put(keys[i], values[i]);
+            negative_.erase(keys[i]);
+        }
+        return out;
+    }
+
+    // Deletes many keys with one kv_mdel statement (or enqueues them).
+    Result mdel(const std::vector<std::string> &keys)
+    {
+        Result out;
+        for (const auto &key : keys)
+        {
+            if (!is_int_key(key))
+            {
+                out.status = Status::BadKey;
+                return out;
+            }
+        }
+
+        if (write_behind_)
+        {
+            std::vector<PendingWrite> writes;
+            writes.reserve(keys.size());
+            for (const auto &key : keys)
+                writes.push_back(PendingWrite{true, key, ""});
+            if (!write_behind_->enqueue_batch(std::move(writes), [&](const PendingWrite &w)
+                                              { cache_.erase(w.key); }))
+                out.status = Status::Busy;
+            return out;
+        }
+
+        DbReply r = exec("kv_mdel", {pg_array_literal(keys)});
+        if (!r.ok())
+        {
+            out.status = Status::DbError;
+            out.value = std::move(r.error);
+            return out;
+        }
+        for (const auto &key : keys)
+            cache_.erase(key);
+        return out;
+    }
+
+    /**
+     *  Looks up many keys at once: cache hits and pending writes are
+     *  answered in one pass, and every remaining key is fetched with a
+     *  single kv_mget round trip. Results line up with `keys`. A database
+     *  failure marks only the keys that needed the database.
+     */
+    std::vector<Result> mget(const std::vector<std::string> &keys)
+    {
+        std::vector<Result> out(keys.size());
+        std::vector<size_t> misses;
+        std::vector<std::string> miss_keys;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            if (cache_.get(keys[i], out[i].value))
+            {
+                out[i].hit = true;
+                continue;
+            }
+            PendingWrite pending;
+            if (write_behind_ && write_behind_->lookup(keys[i], pending))
+            {
+                if (pending.del)
+                    out[i].status = Status::NotFound;
+                else
+                    out[i].value = std::move(pending.value);
+                continue;
+            }
+            // kv_store.k is INTEGER, so anything else cannot be stored
+            if (!is_int_key(keys[i]) || negative_.contains(keys[i]))
+            {
+                out[i].status = Status::NotFound;
+                continue;
+            }
+            misses.push_back(i);
+            miss_keys.push_back(keys[i]);
+        }
+        if (misses.empty())
+            return out;
+
+        std::vector<uint64_t> generations;
+        for (const auto &key : miss_keys)
+            generations.push_back(negative_.generation(key));
+
+        DbReply r = exec("kv_mget", {pg_array_literal(miss_keys)});
+        if (!r.ok())
+        {
+            for (size_t i : misses)
+            {
+                out[i].status = Status::DbError;
+                out[i].value = r.error;
+            }
+            return out;
+        }
+
+        // Rows come back keyed by the integer, which may be spelled
+        // differently from the request ("007" vs "7")
+        PGresult *res = r.res.get();
+        std::unordered_map<long long, int> rows;
+        for (int row = 0; row < PQntuples(res); ++row)
+            rows.emplace(std::stoll(PQgetvalue(res, row, 0)), row);
+        for (size_t m = 0; m < misses.size(); ++m)
+        {
+            size_t i = misses[m];
+            auto it = rows.find(std::stoll(keys[i]));
+            if (it == rows.end())
+            {
+                negative_.put(keys[i], generations[m]);
+                out[i].status = Status::NotFound;
+                continue;
+            }
+            out[i].value.assign(PQgetvalue(res, it->second, 1), PQgetlength(res, it->second, 1));
+            cache_.put(keys[i], out[i].value);
+        }
+        return out;
+    }
+
+    bool handleGet(CivetServer *server, struct mg_connection *conn) override
+    {
+        const auto *ri = mg_get_request_info(conn);
+        if (ri->local_uri && strcmp(ri->local_uri, "/mget") == 0)
+            return doMget(conn, ri);
+        if (ri->local_uri && strcmp(ri->local_uri, "/kv") == 0)
+            return doScan(conn, ri);
+
+        std::string key;
+        bool raw;
+        if (!parseKeyUri(conn, ri, key, raw))
+        {
+            JsonResponse(404).field("error", "not_found").send(conn);
+            return true;
+        }
+        return doGet(conn, key, raw);
+    }
+
+    bool handlePut(CivetServer *server, struct mg_connection *conn) override
+    {
+        const auto *ri = mg_get_request_info(conn);
+        std::string key;
+        bool raw;
+        if (!parseKeyUri(conn, ri, key, raw))
+        {
+            JsonResponse(404).field("error", "not_found").send(conn);
+            return true;
+        }
+        // A binary upload is never JSON, whatever the response format
+        raw = raw || header_has(conn, "Content-Type", "application/octet-stream");
+        return doPut(conn, key, raw);
+    }
+
+    bool handlePost(CivetServer *server, struct mg_connection *conn) override
+    {
+        const auto *ri = mg_get_request_info(conn);
+        const char *uri = ri->local_uri ? ri->local_uri : "";
+        if (strcmp(uri, "/mget") == 0)
+            return doMget(conn, ri);
+        if (strcmp(uri, "/mset") == 0)
+            return doMset(conn);
+        if (strcmp(uri, "/mdel") == 0)
+            return doMdel(conn, ri);
+        if (strcmp(uri, "/import") == 0)
+            return doImport(conn, ri);
+
+        JsonResponse(404).field("error", "not_found").send(conn);
+        return true;
     }
 
-    PGconn *acquire()
+    bool handleDelete(CivetServer *server, struct mg_connection *conn) override
     {
-        std::unique_lock<std::mutex> lk(m_);
-        cv_.wait(lk, [&]
-                 { return !conns_.empty(); });
-        PGconn *c = conns_.front();
-        conns_.pop();
-        return c;
+        const auto *ri = mg_get_request_info(conn);
+        std::string key;
+        bool raw;
+        if (!parseKeyUri(conn, ri, key, raw))
+        {
+            JsonResponse(404).field("error", "not_found").send(conn);
+            return true;
+        }
+        return doDelete(conn, key);
     }
 
-    void release(PGconn *c)
+    json stats() const
     {
-        std::lock_guard<std::mutex> lk(m_);
-        conns_.push(c);
-        cv_.notify_one();
+        json j{{"cache", cache_.stats()},
+               {"negative_cache", negative_.stats()},
+               {"pool", pool_.stats()},
+               {"single_flight", flights_.stats()}};
+        if (write_behind_)
+            j["write_behind"] = write_behind_->stats();
+        if (miss_batcher_)
+            j["miss_batch"] = miss_batcher_->stats();
+        if (group_commit_)
+            j["group_commit"] = group_commit_->stats();
+        j["warmup"] = json{{"running", warmup_running_.load()},
+                           {"rows", warmup_rows_.load()},
+                           {"ms", warmup_ms_.load()}};
+        return j;
     }
 };
 
-static std::string url_decode(const std::string &s)
+// ---------- StatsHandler ----------
+// GET /stats reports live counters (cache usage etc.) as JSON.
+class StatsHandler : public CivetHandler
 {
-    std::string ret;
-    char ch;
-    int i, ii;
-    for (i = 0; i < (int)s.length(); i++)
+private:
+    const KVHandler &kv_;
+
+public:
+    StatsHandler(const KVHandler &kv) : kv_(kv) {}
+
+    bool handleGet(CivetServer *server, struct mg_connection *conn) override
     {
-        if (s[i] == '%')
-        {
-            sscanf(s.substr(i + 1, 2).c_str(), "%x", &ii);
-            ch = static_cast<char>(ii);
-            ret += ch;
-            i = i + 2;
-        }
-        else if (s[i] == '+')
-        {
-            ret += ' ';
-        }
-        else
-        {
-            ret += s[i];
-        }
+        send_json(conn, 200, kv_.stats());
+        return true;
     }
-    return ret;
-}
+};
 
-static void send_json(struct mg_connection *conn, int status, const json &j)
+// ---------- BinaryServer ----------
+/**
+ *  Compact binary protocol on its own TCP port, served by the same
+ *  KVHandler operations as the HTTP API.
+ *
+ *  Request frame (integers big-endian):
+ *      u8 op (1 GET, 2 PUT, 3 DELETE) | u8 0 | u16 key_len | u32 value_len
+ *      key bytes | value bytes (PUT only; value_len is 0 otherwise)
+ *  Response frame:
+ *      u8 status (0 ok, 1 not found, 2 bad request, 3 db error, 4 busy)
+ *      u8 flags (bit 0: cache hit) | u16 0 | u32 payload_len | payload
+ *  The payload is the value for a successful GET, the error message for
+ *  failures, and empty otherwise.
+ *
+ *  Clients may pipeline: every complete frame already received is
+ *  answered in order, and the responses go out in one write before the
+ *  connection blocks for more input. One thread serves each connection,
+ *  like civetweb's workers.
+ */
+class BinaryServer
 {
-    std::string body = j.dump();
-    std::ostringstream oss;
-    oss << "HTTP/1.1 " << status << " \r\n"
-        << "Content-Type: application/json\r\n"
-        << "Content-Length: " << body.size() << "\r\n"
-        << "Connection: close\r\n\r\n"
-        << body;
-    std::string s = oss.str();
-    mg_write(conn, s.c_str(), (int)s.size());
-}
+public:
+    enum Op : uint8_t
+    {
+        OP_GET = 1,
+        OP_PUT = 2,
+        OP_DELETE = 3
+    };
+    enum Reply : uint8_t
+    {
+        REPLY_OK = 0,
+        REPLY_NOT_FOUND = 1,
+        REPLY_BAD_REQUEST = 2,
+        REPLY_DB_ERROR = 3,
+        REPLY_BUSY = 4
+    };
+    static constexpr size_t HEADER = 8;
 
-class LRUCache {
 private:
-    std::list<std::pair<std::string, std::string>> lru_list_;
+    KVHandler &kv_;
+    size_t max_conns_;
+    size_t max_frame_;
+    int listen_fd_ = -1;
+    std::atomic<size_t> conns_{0};
 
-    // The map stores the key and an *iterator* to its position in the list.
-    std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> cache_map_;
+    static uint32_t get_u32(const unsigned char *p)
+    {
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
 
-    size_t max_size_;
-    std::mutex cache_mutex_;
+    static void reply(std::string &out, uint8_t status, uint8_t flags, const std::string &payload)
+    {
+        uint32_t n = (uint32_t)payload.size();
+        char h[HEADER] = {(char)status, (char)flags, 0, 0,
+                          (char)(n >> 24), (char)(n >> 16), (char)(n >> 8), (char)n};
+        out.append(h, HEADER);
+        out += payload;
+    }
 
-public:
-    LRUCache(size_t max_size) : max_size_(max_size) {
-        // Ensure cache size is at least 1
-        if (max_size_ == 0) {
-            max_size_ = 1;
+    void reply(std::string &out, const KVHandler::Result &r)
+    {
+        switch (r.status)
+        {
+        case KVHandler::Status::Ok:
+            reply(out, REPLY_OK, r.hit ? 1 : 0, r.value);
+            break;
+        case KVHandler::Status::NotFound:
+            reply(out, REPLY_NOT_FOUND, 0, "");
+            break;
+        case KVHandler::Status::BadKey:
+            reply(out, REPLY_BAD_REQUEST, 0, "invalid_key");
+            break;
+        case KVHandler::Status::DbError:
+            reply(out, REPLY_DB_ERROR, 0, r.value);
+            break;
+        case KVHandler::Status::Busy:
+            reply(out, REPLY_BUSY, 0, "write_backlog_full");
+            break;
         }
     }
 
-    
-    void put(const std::string& key, const std::string& value) {
-        std::scoped_lock lock(cache_mutex_);
-
-        auto it = cache_map_.find(key);
-
-        // Case 1: Key already in cache. Update value and move to front (MRU).
-        if (it != cache_map_.end()) {
-            // Update the value in the list
-            it->second->second = value;
-            // Move the existing list node to the front
-            lru_list_.splice(lru_list_.begin(), lru_list_, it->second);
-            return;
+    void handle(uint8_t op, const std::string &key, const std::string &value, std::string &out)
+    {
+        switch (op)
+        {
+        case OP_GET:
+            reply(out, kv_.get(key));
+            break;
+        case OP_PUT:
+            reply(out, kv_.put(key, value));
+            break;
+        case OP_DELETE:
+            reply(out, kv_.del(key));
+            break;
+        default:
+            reply(out, REPLY_BAD_REQUEST, 0, "unknown_op");
         }
+    }
 
-        // Case 2: Key is new.
-        // Check if cache is full *before* inserting.
-        if (cache_map_.size() >= max_size_) {
-            // Evict the LRU item (at the back of the list)
-            auto& lru_item = lru_list_.back();
-            cache_map_.erase(lru_item.first);
-            lru_list_.pop_back();
+    static bool write_all(int fd, const std::string &out)
+    {
+        size_t off = 0;
+        while (off < out.size())
+        {
+            ssize_t n = ::send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            off += n;
         }
-
-        // Add the new item to the front (MRU)
-        lru_list_.push_front({key, value});
-        // Store an iterator to the new item in the map
-        cache_map_[key] = lru_list_.begin();
+        return true;
     }
 
-    
-    bool get(const std::string& key, std::string& value_out) {
-        //double k ;
-        // for(int i=0;i<2;i++)
-        // {
-        //     for(int j= 0;j<2;i++)
-        //         for(int k=0;k<2;k++)
-        //         {
-        //             k=(rand()%10000) * (rand()%10000);
-        //         }
-        // }
-        std::scoped_lock lock(cache_mutex_);
-
-        auto it = cache_map_.find(key);
+    void serve(int fd)
+    {
+        std::string in, out, key, value;
+        size_t pos = 0;
+        char chunk[64 * 1024];
+        while (true)
+        {
+            // Answer every complete frame already buffered
+            while (in.size() - pos >= HEADER)
+            {
+                const unsigned char *h = (const unsigned char *)in.data() + pos;
+                size_t key_len = (size_t)h[2] << 8 | h[3];
+                size_t value_len = get_u32(h + 4);
+                if (value_len > max_frame_)
+                {
+                    reply(out, REPLY_BAD_REQUEST, 0, "frame_too_large");
+                    write_all(fd, out);
+                    return;
+                }
+                if (in.size() - pos < HEADER + key_len + value_len)
+                    break;
+                key.assign(in, pos + HEADER, key_len);
+                value.assign(in, pos + HEADER + key_len, value_len);
+                handle(h[0], key, value, out);
+                pos += HEADER + key_len + value_len;
+            }
+            if (!out.empty())
+            {
+                if (!write_all(fd, out))
+                    return;
+                out.clear();
+            }
+            if (pos > 0)
+            {
+                in.erase(0, pos);
+                pos = 0;
+            }
 
-        // Case 1: Key not found (MISS)
-        if (it == cache_map_.end()) {
-            return false;
+            ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            in.append(chunk, n);
         }
+    }
 
-        // Case 2: Key found (HIT)
-        // Move the accessed item to the front (MRU)
-        lru_list_.splice(lru_list_.begin(), lru_list_, it->second);
-        // Copy the value to the output parameter
-        value_out = it->second->second;
-        return true;
+    void accept_loop()
+    {
+        while (true)
+        {
+            int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0)
+            {
+                if (errno != EINTR)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            if (conns_.load() >= max_conns_)
+            {
+                ::close(fd);
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            conns_++;
+            std::thread([this, fd]
+                        {
+                serve(fd);
+                ::close(fd);
+                conns_--; })
+                .detach();
+        }
     }
 
-    /**
-     *  Erases a key from the cache.
-     */
-    void erase(const std::string& key) {
-        std::scoped_lock lock(cache_mutex_);
+public:
+    BinaryServer(KVHandler &kv, size_t max_conns, size_t max_frame)
+        : kv_(kv), max_conns_(max_conns), max_frame_(max_frame) {}
 
-        auto it = cache_map_.find(key);
-        if (it != cache_map_.end()) {
-            lru_list_.erase(it->second);
-            cache_map_.erase(it);
-        }
+    // Binds the port and starts accepting; throws if the port is unusable.
+    void start(uint16_t port)
+    {
+        listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0)
+            throw std::runtime_error(std::string("binary listener: socket: ") + strerror(errno));
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (::bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listen_fd_, 128) != 0)
+            throw std::runtime_error("binary listener: cannot listen on port " + std::to_string(port) +
+                                     ": " + strerror(errno));
+        std::thread([this]
+                    { accept_loop(); })
+            .detach();
     }
 };
 
 
-// ---------- KVHandler ----------
-class KVHandler : public CivetHandler
+// ---------- Cache benchmark ----------
+// `kv_server --bench-cache [threads] [ops_per_thread]` runs a GET-heavy
+// (95% get / 5% put) in-memory workload against each cache policy, then
+// measures each policy's hit ratio on skewed and scan-polluted key
+// streams, so the policies can be compared without Postgres or HTTP.
+static int run_cache_bench(int argc, char **argv)
 {
-private:
-    PGPool &pool_;
-    // --- CACHE ---
-    // Our in-memory cache and the mutex to protect it.
-    LRUCache cache_;
-    // --- END CACHE ---
+    size_t threads = argc > 2 ? std::stoul(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+    size_t ops = argc > 3 ? std::stoul(argv[3]) : 1000000;
+    size_t shards = env_size("CACHE_SHARDS", CACHE_DEFAULT_SHARDS);
+    const size_t items = CACHE_MAX_ITEMS;
 
-    
-    void warmUpCache(size_t limit)
-    {
-        std::cout << "Warming up cache from database..." << std::endl;
-        PGconn *pg = pool_.acquire();////
-        std::cout << "DEBUG 1: Connection acquired.\n";
-        std::string query = "SELECT k, v FROM kv_store ORDER BY updated_at DESC LIMIT " + std::to_string(limit);
-        std::cout << "DEBUG 2: Running query: " << query << "\n";////
-        PGresult *res = PQexec(pg, query.c_str());
-        std::cout << "DEBUG 3: Query finished execution.\n";//
+    // Keys and values are built up front so allocation stays out of the loop
+    std::vector<std::string> keys;
+    for (size_t k = 0; k < items; ++k)
+        keys.push_back(std::to_string(k));
+    const std::string value(128, 'v');
 
-        if (PQresultStatus(res) == PGRES_TUPLES_OK)
+    std::cout << "policy  shards  threads  Mops/s\n";
+    for (const char *policy : {"lru", "clock", "tinylfu"})
+    {
+        for (size_t n_shards : {(size_t)1, shards})
         {
-            int rows = PQntuples(res);
-            //lock inside cache_.put()
+            CacheConfig config;
+            config.max_items = items;
+            config.shards = n_shards;
+            config.policy = policy;
+            ShardedCache cache(config);
+            for (size_t k = 0; k < items; ++k)
+                cache.put(keys[k], value);
 
-            for (int i = 0; i < rows; i++)
+            std::vector<std::thread> workers;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < threads; ++t)
             {
-                char *key = PQgetvalue(res, i, 0);
-                char *val = PQgetvalue(res, i, 1);
-                if (key && val)
-                {
-                    // This will fill the cache up to its max size
-                    // and automatically apply the eviction policy
-                    cache_.put( std::string(key) , std::string(val));
-                }
+                workers.emplace_back([&, t]
+                                     {
+                    std::string out;
+                    uint64_t x = 0x9E3779B97F4A7C15ull * (t + 1);
+                    for (size_t i = 0; i < ops; ++i) {
+                        // xorshift keeps the generator out of the measurement
+                        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                        const std::string &key = keys[x % items];
+                        if ((x >> 40) % 100 < 95)
+                            cache.get(key, out);
+                        else
+                            cache.put(key, value);
+                    } });
             }
-            std::cout << "Cache warm-up complete. Loaded " << rows << " items.\n";
-        }
-        else
-        {
-            std::cerr << "Cache warm-up failed: " << PQerrorMessage(pg) << std::endl;
-        }
-        PQclear(res);
-        pool_.release(pg);
-    }
+            for (auto &w : workers)
+                w.join();
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    bool doGet(struct mg_connection *conn, const std::string &key)
-    {
-        // --- CACHE ---
-        // 1. Check cache first
-        std::string value;
-        if (cache_.get(key, value)) {
-            // CACHE HIT!
-            send_json(conn, 200, json{
-                                    {"key", key},
-                                    {"value", value},
-                                    {"cache", "HIT"}});
-            return true;
+            std::cout << policy << "\t" << cache.shard_count() << "\t" << threads << "\t"
+                      << (threads * ops) / secs / 1e6 << "\n";
         }
-        // CACHE MISS.
-        // --- END CACHE ---
+    }
 
-        PGconn *pg = pool_.acquire();
-        const char *paramValues[1] = {key.c_str()};
-        PGresult *res = PQexecPrepared(pg, "kv_get", 1, paramValues, nullptr, nullptr, 0);
+    // Hit ratio, simulating doGet (insert on miss) over a keyspace 10x the
+    // cache: Zipf(0.99) popularity, then the same with a 20% share of
+    // sequential one-off keys (a scan) mixed in.
+    const size_t keyspace = items * 10;
+    std::vector<double> cdf(keyspace);
+    double sum = 0;
+    for (size_t k = 0; k < keyspace; ++k)
+        cdf[k] = (sum += 1.0 / std::pow((double)(k + 1), 0.99));
+    std::vector<std::string> zipf_keys;
+    for (size_t k = 0; k < keyspace; ++k)
+        zipf_keys.push_back(std::to_string(k));
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    std::cout << "\npolicy  workload  hit_ratio\n";
+    for (const char *policy : {"lru", "clock", "tinylfu"})
+    {
+        for (int scan_percent : {0, 20})
         {
-            std::string err = PQerrorMessage(pg);
-            PQclear(res);
-            pool_.release(pg);
-            send_json(conn, 500, json{{"error", "db_error"}, {"message", err}});
-            return true;
-        }
+            CacheConfig config;
+            config.max_items = items;
+            config.shards = shards;
+            config.policy = policy;
+            ShardedCache cache(config);
 
-        if (PQntuples(res) == 0)
-        {
-            PQclear(res);
-            pool_.release(pg);
-            send_json(conn, 404, json{{"error", "not_found"}, {"cache", "MISS"}});
-            return true;
+            uint64_t x = 0x2545F4914F6CDD1Dull, hits = 0, total = 0, scan = keyspace;
+            std::string out;
+            for (size_t i = 0; i < ops; ++i)
+            {
+                x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                std::string key;
+                if ((int)(x % 100) < scan_percent)
+                    key = std::to_string(scan++);
+                else
+                {
+                    double u = (double)(x >> 11) / (double)(1ull << 53) * sum;
+                    key = zipf_keys[std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()];
+                }
+                ++total;
+                if (cache.get(key, out))
+                    ++hits;
+                else
+                    cache.put(key, value);
+            }
+            std::cout << policy << "\t" << (scan_percent ? "zipf+scan" : "zipf") << "\t"
+                      << (double)hits / total << "\n";
         }
+    }
+    return 0;
+}
 
-        char *val = PQgetvalue(res, 0, 0);
-        int len = PQgetlength(res, 0, 0);
-        std::string db_value(val, len);
-        PQclear(res);
-        pool_.release(pg);
 
-        // --- CACHE ---
-        // 3. Store the retrieved value in the cache
-        cache_.put(key, db_value);
-        // --- END CACHE ---
+// ---------- Pool handoff benchmark ----------
+// The handoff PGPool used before SlotHandoff: one mutex, a std::queue and
+// a condition_variable signalled on every release.
+template <typename T>
+class MutexHandoff
+{
+private:
+    std::queue<T> items_;
+    std::mutex m_;
+    std::condition_variable cv_;
 
-        send_json(conn, 200, json{
-                                {"key", key},
-                                {"value", db_value},
-                                {"cache", "MISS"}});
+public:
+    bool take_until(T &out, std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lk(m_);
+        if (!cv_.wait_until(lk, deadline, [&]
+                            { return !items_.empty(); }))
+            return false;
+        out = items_.front();
+        items_.pop();
         return true;
     }
 
-    bool doPut(struct mg_connection *conn, const std::string &key, const struct mg_request_info *ri)
+    void give(T v)
     {
-        long long len = ri->content_length;
-        std::string body;
-        if (len > 0)
-        {
-            body.resize(len);
-            long long r = mg_read(conn, (void *)body.data(), len);
-            body.resize((size_t)r);
-        }
+        std::lock_guard<std::mutex> lk(m_);
+        items_.push(v);
+        cv_.notify_one();
+    }
+};
 
-        // If client sends JSON { "value": "..." }
-        std::string value = body;
-        try
-        {
-            json j = json::parse(body);
-            if (j.contains("value"))
-                value = j["value"].get<std::string>();
-        }
-        catch (...)
-        {
-            //  treat as raw string
-        }
+template <typename Handoff>
+static void bench_handoff(const char *name, Handoff &handoff, size_t threads, size_t total_ops)
+{
+    size_t ops = std::max<size_t>(1, total_ops / threads);
+    std::vector<std::vector<uint32_t>> lat(threads); // acquire latency, ns
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t]
+                             {
+            lat[t].reserve(ops);
+            void *item = nullptr;
+            for (size_t i = 0; i < ops; ++i) {
+                auto a = std::chrono::steady_clock::now();
+                handoff.take_until(item, a + std::chrono::seconds(60));
+                auto b = std::chrono::steady_clock::now();
+                lat[t].push_back((uint32_t)std::min<int64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(b - a).count(), UINT32_MAX));
+                handoff.give(item);
+            } });
+    }
+    for (auto &w : workers)
+        w.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-        PGconn *pg = pool_.acquire();
-        const char *paramValues[2] = {key.c_str(), value.c_str()};
-        PGresult *res = PQexecPrepared(pg, "kv_put", 2, paramValues, nullptr, nullptr, 0);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK)
-        {
-            std::string err = PQerrorMessage(pg);
-            PQclear(res);
-            pool_.release(pg);
-            send_json(conn, 500, json{{"error", "db_error"}, {"message", err}});
-            return true;
-        }
-        PQclear(res);
-        pool_.release(pg);
+    std::vector<uint32_t> all;
+    for (auto &l : lat)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    double avg = 0;
+    for (uint32_t v : all)
+        avg += v;
+    avg /= all.size();
+    std::cout << name << "\t" << threads << "\t" << (uint64_t)avg << "\t"
+              << all[all.size() * 99 / 100] << "\t" << all.size() / secs / 1e6 << "\n";
+}
 
-        // --- CACHE ---
-        // DB write was successful, now update the cache.
-        cache_.put(key, value);
-        // --- END CACHE ---
-        send_json(conn, 200, json{{"status", "ok"}, {"key", key}, {"value", value}});
-        return true;
-    }
+// `kv_server --bench-pool [total_ops]` compares PGPool's old mutex/queue
+// handoff with the lock-free SlotHandoff: acquire latency and
+// acquire+release throughput with PG_POOL_MAX slots at 1, 8, 64 and 512
+// contending threads. Slots are dummy pointers, so no Postgres needed.
+static int run_pool_bench(int argc, char **argv)
+{
+    size_t total_ops = argc > 2 ? std::stoul(argv[2]) : 2000000;
+    size_t slots = env_size("PG_POOL_MAX", PG_POOL_MAX);
+    std::vector<char> dummies(slots);
 
-    bool doDelete(struct mg_connection *conn, const std::string &key)
+    std::cout << "handoff   threads  avg_ns  p99_ns  Mops/s\n";
+    for (size_t threads : {1, 8, 64, 512})
     {
-        PGconn *pg = pool_.acquire();
-        const char *paramValues[1] = {key.c_str()};
-        PGresult *res = PQexecPrepared(pg, "kv_del", 1, paramValues, nullptr, nullptr, 0);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        MutexHandoff<void *> locked;
+        SlotHandoff<void *> lockfree(slots);
+        for (auto &d : dummies)
         {
-            std::string err = PQerrorMessage(pg);
-            PQclear(res);
-            pool_.release(pg);
-            send_json(conn, 500, json{{"error", "db_error"}, {"message", err}});
-            return true;
+            locked.give(&d);
+            lockfree.give(&d);
         }
-        PQclear(res);
-        pool_.release(pg);
-
-         // --- CACHE ---
-        // DB delete was successful, now remove from cache.
-        cache_.erase(key);
-        // --- END CACHE ---
-        send_json(conn, 200, json{{"status", "deleted"}, {"key", key}});
-        return true;
+        bench_handoff("mutex", locked, threads, total_ops);
+        bench_handoff("lockfree", lockfree, threads, total_ops);
     }
+    return 0;
+}
 
-public:
-    KVHandler(PGPool &pool, size_t cache_size) 
-        : pool_(pool), cache_(cache_size)
+// ---------- Bulk import CLI ----------
+// `kv_server --import <file|-> [conninfo]` loads "key<TAB>value" lines
+// (see BulkImport) into kv_store in one transaction, logging throughput
+// as it goes. A running server's cache is not touched; use POST /import
+// to load through the server instead.
+static int run_import_cli(int argc, char **argv, const std::string &default_conninfo)
+{
+    if (argc < 3)
     {
-        // --- CACHE ---
-        //warmUpCache(CACHE_MAX_ITEMS);
-        // --- END CACHE ---
+        std::cerr << "usage: kv_server --import <file|-> [conninfo]" << std::endl;
+        return 2;
     }
-
-    bool handleGet(CivetServer *server, struct mg_connection *conn) override
+    std::string path = argv[2];
+    FILE *in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+    if (!in)
     {
-        const auto *ri = mg_get_request_info(conn);
-        std::string uri = ri->local_uri ? ri->local_uri : "";
-
-        if (uri.rfind("/kv/", 0) != 0)
-        {
-            send_json(conn, 404, json{{"error", "not_found"}});
-            return true;
-        }
-        std::string key = url_decode(uri.substr(4));
-        return doGet(conn, key);
+        std::cerr << "Cannot open " << path << ": " << strerror(errno) << std::endl;
+        return 1;
     }
 
-    bool handlePut(CivetServer *server, struct mg_connection *conn) override
+    try
     {
-        const auto *ri = mg_get_request_info(conn);
-        std::string uri = ri->local_uri ? ri->local_uri : "";
+        PoolConfig config;
+        config.min_size = config.max_size = 1;
+        PGPool pool(argc > 3 ? argv[3] : default_conninfo, config);
+        PGconn *pg = pool.acquire();
+        if (!pg)
+            throw std::runtime_error("no database connection");
+
+        BulkImport import(pg, 0);
+        std::vector<char> block(BODY_BLOCK_SIZE);
+        size_t n;
+        while ((n = fread(block.data(), 1, block.size(), in)) > 0)
+            if (!import.write(block.data(), n))
+                break;
+        bool ok = !ferror(in) && import.finish();
+        pool.release(pg);
+        if (in != stdin)
+            fclose(in);
 
-        if (uri.rfind("/kv/", 0) != 0)
+        if (!ok)
         {
-            send_json(conn, 404, json{{"error", "not_found"}});
-            return true;
+            std::cerr << "Import failed: " << (import.error().empty() ? "read error" : import.error()) << std::endl;
+            return 1;
         }
-        std::string key = url_decode(uri.substr(4));
-        return doPut(conn, key, ri);
+        std::cout << "Imported " << import.rows() << " rows (" << import.bytes() << " bytes) in "
+                  << import.seconds() << " s, " << (size_t)import.rows_per_sec() << " rows/s" << std::endl;
+        return 0;
     }
-
-    bool handleDelete(CivetServer *server, struct mg_connection *conn) override
+    catch (const std::exception &ex)
     {
-        const auto *ri = mg_get_request_info(conn);
-        std::string uri = ri->local_uri ? ri->local_uri : "";
-
-        if (uri.rfind("/kv/", 0) != 0)
-        {
-            send_json(conn, 404, json{{"error", "not_found"}});
-            return true;
-        }
-        std::string key = url_decode(uri.substr(4));
-        return doDelete(conn, key);
+        std::cerr << "Fatal: " << ex.what() << std::endl;
+        return 1;
     }
-};
-
+}
 
 int main(int argc, char **argv)
 {
-    const std::string conninfo =
-        argc > 1 ? argv[1]
-                 : "host=kv_postgres port=5432 dbname=kvdb user=kvuser password=kvpass";
+    if (argc > 1 && std::string(argv[1]) == "--bench-cache")
+        return run_cache_bench(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--bench-pool")
+        return run_pool_bench(argc, argv);
+
+    const std::string default_conninfo = "host=kv_postgres port=5432 dbname=kvdb user=kvuser password=kvpass";
+    if (argc > 1 && std::string(argv[1]) == "--import")
+        return run_import_cli(argc, argv, default_conninfo);
+
+    const std::string conninfo = argc > 1 ? argv[1] : default_conninfo;
     try
     {
-        PGPool pool(conninfo, 4);
+        PoolConfig pool_config;
+        pool_config.min_size = env_size("PG_POOL_MIN", PG_POOL_MIN);
+        pool_config.max_size = env_size("PG_POOL_MAX", PG_POOL_MAX);
+        pool_config.acquire_timeout_ms = env_size("PG_ACQUIRE_TIMEOUT_MS", PG_ACQUIRE_TIMEOUT_MS);
+        pool_config.health_interval_ms = env_size("PG_HEALTH_INTERVAL_MS", PG_HEALTH_INTERVAL_MS);
+        pool_config.idle_timeout_ms = env_size("PG_IDLE_TIMEOUT_MS", PG_IDLE_TIMEOUT_MS);
+        PGPool pool(conninfo, pool_config);
 
+        // Persistent connections: each open connection holds a civetweb
+        // worker until it idles out, so clients beyond HTTP_THREADS wait
+        // unserved. Opt-in; enable only with HTTP_THREADS at least the
+        // number of concurrent clients.
+        http_keep_alive = env_string("HTTP_KEEP_ALIVE", "no") == "yes";
+        put_stream_threshold = env_size("PUT_STREAM_THRESHOLD", PUT_STREAM_THRESHOLD);
+        if (env_string("HTTP_DATE_HEADER", "no") == "yes")
+            HttpDate::instance().start();
+        std::string num_threads = std::to_string(env_size("HTTP_THREADS", HTTP_THREADS));
+        std::string keep_alive_ms = std::to_string(env_size("HTTP_KEEP_ALIVE_MS", HTTP_KEEP_ALIVE_MS));
         const char *options[] = {
-            "document_root", ".", "listening_ports", "8080", nullptr};
+            "document_root", ".", "listening_ports", "8080",
+            "enable_keep_alive", http_keep_alive ? "yes" : "no",
+            "keep_alive_timeout_ms", keep_alive_ms.c_str(),
+            "num_threads", num_threads.c_str(), nullptr};
         CivetServer server(options);
         
-        // Pass the cache size to the handler
-        KVHandler handler(pool,CACHE_MAX_ITEMS);
-        
+        // Pass the cache limits, shard count and eviction policy to the handler
+        CacheConfig cache_config;
+        cache_config.max_items = env_size("CACHE_MAX_ITEMS", CACHE_MAX_ITEMS);
+        cache_config.max_bytes = env_size("CACHE_MAX_BYTES", CACHE_MAX_BYTES);
+        cache_config.shards = env_size("CACHE_SHARDS", CACHE_DEFAULT_SHARDS);
+        cache_config.policy = env_string("CACHE_POLICY", CACHE_DEFAULT_POLICY);
+        cache_config.negative_max_items = env_size("NEG_CACHE_MAX_ITEMS", NEG_CACHE_MAX_ITEMS);
+        cache_config.negative_ttl_ms = env_size("NEG_CACHE_TTL_MS", NEG_CACHE_TTL_MS);
+        cache_config.warmup_slices = env_size("CACHE_WARMUP_SLICES", CACHE_WARMUP_SLICES);
+
+        // DB_MODE=pipeline multiplexes point statements over a few
+        // pipelined connections; the default runs them on the pool.
+        std::unique_ptr<PGPipeline> pipeline;
+        if (env_string("DB_MODE", "pool") == "pipeline")
+        {
+            size_t conns = env_size("PG_PIPELINE_CONNS", PG_PIPELINE_CONNS);
+            size_t depth = env_size("PG_PIPELINE_DEPTH", PG_PIPELINE_DEPTH);
+            pipeline = std::make_unique<PGPipeline>(conninfo, conns, depth);
+            std::cout << "DB: pipeline mode, " << conns << " connections, batches of up to " << depth << "\n";
+        }
+
+        // WRITE_MODE=writebehind acknowledges PUT/DELETE once queued and
+        // journaled, and commits them to Postgres in batches.
+        std::unique_ptr<WriteBehindQueue> write_behind;
+        if (env_string("WRITE_MODE", "sync") == "writebehind")
+        {
+            WriteBehindConfig wb;
+            wb.flush_ms = env_size("WB_FLUSH_MS", WB_FLUSH_MS);
+            wb.batch_max = env_size("WB_BATCH_MAX", WB_BATCH_MAX);
+            wb.journal = env_string("WB_JOURNAL", WB_JOURNAL);
+            wb.max_pending = env_size("WB_MAX_PENDING", WB_MAX_PENDING);
+            write_behind = std::make_unique<WriteBehindQueue>(pool, wb);
+            std::cout << "Writes: write-behind, flush every " << wb.flush_ms << " ms or "
+                      << wb.batch_max << " writes, journal " << wb.journal << "\n";
+        }
+
+        // Concurrent cache misses are grouped into one kv_mget per batch
+        // unless MISS_BATCH_WINDOW_US=0. A miss with nothing else in
+        // flight goes out at once.
+        std::unique_ptr<MissBatcher> miss_batcher;
+        MissBatchConfig mb;
+        mb.window_us = env_size("MISS_BATCH_WINDOW_US", MISS_BATCH_WINDOW_US);
+        mb.max_keys = env_size("MISS_BATCH_MAX_KEYS", MISS_BATCH_MAX_KEYS);
+        mb.workers = env_size("MISS_BATCH_WORKERS", MISS_BATCH_WORKERS);
+        if (mb.window_us > 0)
+        {
+            PGPipeline *p = pipeline.get();
+            miss_batcher = std::make_unique<MissBatcher>(
+                [&pool, p](const std::vector<std::string> &keys)
+                { return run_statement(pool, p, "kv_mget", {pg_array_literal(keys)}); },
+                mb);
+            std::cout << "Reads: misses batched over " << mb.window_us << " us, up to " << mb.max_keys
+                      << " keys, " << mb.workers << " batches in flight\n";
+        }
+
+        // WRITE_MODE=group acknowledges PUT/DELETE once committed, like
+        // the default, but commits concurrent writes together.
+        std::unique_ptr<GroupCommit> group_commit;
+        if (env_string("WRITE_MODE", "sync") == "group")
+        {
+            size_t max = env_size("GROUP_COMMIT_MAX", GROUP_COMMIT_MAX);
+            group_commit = std::make_unique<GroupCommit>(pool, max);
+            std::cout << "Writes: group commit, up to " << max << " writes per transaction\n";
+        }
+
+        KVHandler handler(pool, cache_config, pipeline.get(), write_behind.get(), miss_batcher.get(),
+                          group_commit.get());
+        StatsHandler stats_handler(handler);
+
         server.addHandler("/kv", handler);
+        server.addHandler("/raw", handler);
+        server.addHandler("/mget", handler);
+        server.addHandler("/mset", handler);
+        server.addHandler("/mdel", handler);
+        server.addHandler("/import", handler);
+        server.addHandler("/stats", stats_handler);
+
+        BinaryServer binary(handler, env_size("BIN_MAX_CONNS", BIN_MAX_CONNS),
+                            env_size("BIN_MAX_FRAME", BIN_MAX_FRAME));
+        if (size_t bin_port = env_size("BIN_PORT", BIN_PORT))
+        {
+            binary.start((uint16_t)bin_port);
+            std::cout << "Binary protocol listening on port " << bin_port << "\n";
+        }
 
         std::cout << "KV Server listening on http://0.0.0.0:8080\n";
         while (true)